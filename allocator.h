@@ -14,6 +14,21 @@
 // maximum size of block that must be accommodated
 #define MAX_REQUEST_SIZE (1 << 30)
 
+// Counters reported by mystats
+struct heap_stats {
+    size_t bytes_in_use;        // bytes in allocated blocks, headers included
+    size_t bytes_free;          // bytes in free blocks, headers included
+    size_t free_blocks;         // number of free blocks
+    size_t largest_free;        // payload of the largest free block
+    size_t mallocs;             // successful allocations of any kind
+    size_t frees;               // frees of non-NULL pointers
+    size_t reallocs;            // successful reallocs of an existing block
+    size_t reallocs_in_place;   // ... that kept the block where it was
+    size_t reallocs_moved;      // ... that moved the payload to a new block
+    size_t splits;              // free blocks split in two
+    size_t coalesces;           // pairs of neighbouring blocks merged
+};
+
 
 
 /* Function: myinit
@@ -34,6 +49,35 @@ bool myinit(void *segment_start, size_t segment_size);
 void *mymalloc(size_t size);
 
 
+/* Function: myaligned_alloc
+ * -------------------------
+ * Custom version of aligned_alloc. Returns a block of at least size bytes
+ * whose address is a multiple of alignment, or NULL if alignment is not a
+ * power of two. The block is freed with myfree like any other; myrealloc
+ * only keeps the usual ALIGNMENT if it has to move the block.
+ */
+void *myaligned_alloc(size_t alignment, size_t size);
+
+
+/* Function: mycalloc
+ * -------------------
+ * Custom version of calloc. Returns a zeroed block of nmemb * size bytes,
+ * or NULL if that product overflows. Memory the heap has never handed out
+ * is not zeroed again, which relies on the segment passed to myinit being
+ * zero-filled, as it is when it comes fresh from mmap.
+ */
+void *mycalloc(size_t nmemb, size_t size);
+
+
+/* Function: mymalloc_batch
+ * ------------------------
+ * Allocates n blocks of size bytes each and stores them in out[0..n-1].
+ * Returns how many were allocated, which is less than n only if the heap
+ * ran out; the blocks that were allocated are still valid in that case.
+ */
+size_t mymalloc_batch(size_t size, size_t n, void *out[]);
+
+
 /* Function: myrealloc
  * -------------------
  * Custom version of realloc.
@@ -41,6 +85,16 @@ void *mymalloc(size_t size);
 void *myrealloc(void *ptr, size_t new_size);
 
 
+/* Function: myusable_size
+ * ------------------------
+ * Returns how many bytes of the block at ptr the caller may use, which is
+ * at least the size it asked for (0 for NULL). All of them are kept when
+ * the block is reallocated. The bump allocator keeps no sizes and always
+ * returns 0.
+ */
+size_t myusable_size(void *ptr);
+
+
 /* Function: myfree
  * ----------------
  * Custom version of free.
@@ -48,6 +102,33 @@ void *myrealloc(void *ptr, size_t new_size);
 void myfree(void *ptr);
 
 
+/* Function: myfree_sized
+ * ----------------------
+ * Same as myfree, for callers that still know the size they asked for
+ * when the block was allocated or last reallocated. Builds without
+ * NDEBUG check that size against the block.
+ */
+void myfree_sized(void *ptr, size_t size);
+
+
+/* Function: myfree_batch
+ * ----------------------
+ * Frees the n blocks in ptrs (NULL entries are skipped). The array is
+ * sorted by address in the process.
+ */
+void myfree_batch(void *ptrs[], size_t n);
+
+
+/* Function: mystats
+ * ------------------
+ * Fills in stats with the allocator's counters, which are kept up to date
+ * as the heap changes so that reading them is cheap. Counters an allocator
+ * has no use for are reported as 0. Provided by the bump, implicit,
+ * explicit and hoard allocators.
+ */
+void mystats(struct heap_stats *stats);
+
+
 /* Function: validate_heap
  * -----------------------
  * This is the hook for your heap consistency checker. Returns true
@@ -57,4 +138,43 @@ void myfree(void *ptr);
  */
 bool validate_heap(void);
 
+
+/* Type: heap_t
+ * ------------
+ * A handle on a heap of its own, for callers that want more than the one
+ * heap behind the functions above. Each heap_ function below does the same
+ * as the my function of the same name, on the given heap only; a block must
+ * be freed or reallocated through the heap it came from. The mymalloc family
+ * works on a default heap set up by myinit. Provided by the bump, implicit
+ * and explicit allocators. When the explicit allocator is built with
+ * -DTHREAD_SAFE, any of these functions (and the my functions) may be
+ * called from several threads at once, on the same heap or on different
+ * ones; heap_create and myinit still need the heap to be idle.
+ */
+typedef struct heap heap_t;
+
+
+/* Function: heap_create
+ * ---------------------
+ * Sets up a heap in the given segment and returns its handle, or NULL if
+ * the segment is too small. The heap's own state is kept at the front of
+ * the segment, so there is nothing to destroy: the heap is gone once the
+ * segment is reused or unmapped. Calling heap_create again on the same
+ * segment resets that heap to an empty state. Like myinit, it relies on a
+ * segment it has not seen before being zero-filled.
+ */
+heap_t *heap_create(void *segment_start, size_t segment_size);
+
+void *heap_malloc(heap_t *heap, size_t size);
+void *heap_aligned_alloc(heap_t *heap, size_t alignment, size_t size);
+void *heap_calloc(heap_t *heap, size_t nmemb, size_t size);
+size_t heap_malloc_batch(heap_t *heap, size_t size, size_t n, void *out[]);
+void *heap_realloc(heap_t *heap, void *ptr, size_t new_size);
+size_t heap_usable_size(heap_t *heap, void *ptr);
+void heap_free(heap_t *heap, void *ptr);
+void heap_free_sized(heap_t *heap, void *ptr, size_t size);
+void heap_free_batch(heap_t *heap, void *ptrs[], size_t n);
+void heap_stats(heap_t *heap, struct heap_stats *stats);
+bool heap_validate(heap_t *heap);
+
 #endif
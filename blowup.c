@@ -0,0 +1,185 @@
+/*
+ * File: blowup.c
+ * --------------
+ * Measures how much memory an allocator holds on to when the memory one
+ * thread frees has to be reused by another. A number of threads take
+ * turns. On its turn a thread frees every block the previous thread
+ * allocated, then allocates its own batch of blocks totalling the live
+ * size and writes to all of them. The live data never exceeds one batch,
+ * so an allocator that hands freed memory to whichever thread asks next
+ * keeps its footprint near the live size. One that keeps freed memory
+ * with the thread or heap it came from grows with the number of threads.
+ *
+ * The footprint is the number of bytes of the segment that have ever been
+ * touched. mincore reports it after every round of turns. Only one thread
+ * runs at a time, so every allocator can be measured, thread-safe or not.
+ *
+ * When you compile using `make blowup_<allocator>`, it will create this
+ * program for that allocator. Usage:
+ *     ./blowup_hoard [-t threads] [-r rounds] [-l live MiB]
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "segment.h"
+
+const long HEAP_SIZE = 1L << 32;
+
+// Most blocks a single turn may allocate
+#define MAX_BLOCKS (1 << 22)
+
+static int nthreads = 8;
+static int nrounds = 4;
+static size_t live_size = (size_t)16 << 20;
+
+// State shared by the threads, guarded by turn_lock
+static pthread_mutex_t turn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t turn_changed = PTHREAD_COND_INITIALIZER;
+static int turn;                // number of turns taken so far
+static void **blocks;           // blocks allocated on the last turn
+static size_t nblocks;
+static size_t peak_footprint;
+static int failed;
+
+
+/* Function: block_size
+ * --------------------
+ * Picks the size of the next block from the given seed.
+ */
+static size_t block_size(unsigned int *seed) {
+    int pick = rand_r(seed) % 100;
+    if (pick < 85) {
+        return 8 + rand_r(seed) % 504;
+    } else if (pick < 99) {
+        return 512 + rand_r(seed) % 3584;
+    }
+    return 16384 + rand_r(seed) % 49152;
+}
+
+/* Function: footprint
+ * -------------------
+ * Returns the number of bytes of the segment that are backed by memory,
+ * which for an anonymous mapping is every page that has been touched.
+ */
+static size_t footprint(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t npages = heap_segment_size() / page;
+    unsigned char *resident = malloc(npages);
+    if (resident == NULL || mincore(heap_segment_start(), heap_segment_size(), resident) != 0) {
+        perror("mincore");
+        exit(1);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < npages; i++) {
+        count += resident[i] & 1;
+    }
+    free(resident);
+    return count * page;
+}
+
+/* Function: take_turn
+ * -------------------
+ * Frees the blocks of the previous turn, then allocates and fills a new
+ * batch that adds up to the live size.
+ */
+static void take_turn(unsigned int *seed) {
+    for (size_t i = 0; i < nblocks; i++) {
+        myfree(blocks[i]);
+    }
+    nblocks = 0;
+
+    size_t total = 0;
+    while (total < live_size && nblocks < MAX_BLOCKS) {
+        size_t size = block_size(seed);
+        void *ptr = mymalloc(size);
+        if (ptr == NULL) {
+            printf("mymalloc(%zu) failed with %zu bytes live\n", size, total);
+            failed = 1;
+            return;
+        }
+        memset(ptr, 0xab, size);
+        blocks[nblocks++] = ptr;
+        total += size;
+    }
+}
+
+/* Function: worker
+ * ----------------
+ * Waits for each of this thread's turns and takes it. The last thread of a
+ * round reports the footprint.
+ */
+static void *worker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    unsigned int seed = id + 1;
+    for (int round = 0; round < nrounds; round++) {
+        pthread_mutex_lock(&turn_lock);
+        while (turn != round * nthreads + id) {
+            pthread_cond_wait(&turn_changed, &turn_lock);
+        }
+        if (!failed) {
+            take_turn(&seed);
+        }
+        if (id == nthreads - 1 && !failed) {
+            size_t bytes = footprint();
+            if (bytes > peak_footprint) {
+                peak_footprint = bytes;
+            }
+            printf("round %d: footprint %6.1f MiB, %.2f times the live size\n",
+                round + 1, bytes / 1048576.0, (double)bytes / live_size);
+        }
+        turn++;
+        pthread_cond_broadcast(&turn_changed);
+        pthread_mutex_unlock(&turn_lock);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "t:r:l:")) != EOF) {
+        switch (c) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'r': nrounds = atoi(optarg); break;
+            case 'l': live_size = (size_t)atoi(optarg) << 20; break;
+            default:
+                fprintf(stderr, "usage: %s [-t threads] [-r rounds] [-l live MiB]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (nthreads < 1 || nrounds < 1 || live_size == 0) {
+        fprintf(stderr, "threads, rounds and live size must be positive\n");
+        return 1;
+    }
+
+    init_heap_segment(HEAP_SIZE);
+    if (!myinit(heap_segment_start(), heap_segment_size())) {
+        printf("myinit() returned false\n");
+        return 1;
+    }
+    blocks = malloc(MAX_BLOCKS * sizeof(void *));
+
+    printf("%d threads taking turns, %d rounds, %.1f MiB live\n",
+        nthreads, nrounds, live_size / 1048576.0);
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (failed) {
+        return 1;
+    }
+    printf("peak footprint %.1f MiB, %.2f times the live size\n",
+        peak_footprint / 1048576.0, (double)peak_footprint / live_size);
+    free(threads);
+    free(blocks);
+    return 0;
+}
@@ -0,0 +1,471 @@
+/* File: buddy.c
+ * -------------
+ * A binary buddy allocator. The heap is managed as one power-of-two arena
+ * that is recursively split in halves; every block has a power-of-two size
+ * (its "order") and sits at an offset that is a multiple of that size, so
+ * the buddy of a block is found by flipping one bit of its offset. Freed
+ * blocks merge with their buddy for as long as the buddy is free too.
+ *
+ * Blocks carry no header at all. The state of the split tree lives in two
+ * bitmaps placed after the arena at the top of the segment, with one bit per
+ * node of the tree for each:
+ * - split_bits: the node has been split into two children
+ * - free_bits: the node is a whole free block sitting on a free list
+ * myfree recovers the order of a block by walking down from the root
+ * through split nodes, and checks the free bit of the buddy to merge.
+ * Free blocks are kept on one doubly-linked list per order, with the links
+ * stored in the free block itself.
+ *
+ * Bits are only ever read for nodes whose parent is split, and splitting
+ * writes both children's bits, so myinit does not need to clear the bitmaps.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "debug_break.h"
+
+// Smallest block is 16 bytes, enough to hold the free list links
+#define MIN_ORDER 4
+#define MAX_ORDERS 48
+
+typedef struct free_node {
+    struct free_node *next;
+    struct free_node *prev;
+} free_node_t;
+
+static size_t nused;        // bytes in allocated blocks
+
+static char *arena;         // start of the power-of-two region being split
+static int max_order;       // order of the whole arena
+static unsigned char *split_bits;
+static unsigned char *free_bits;
+static size_t order_base[MAX_ORDERS];       // bit index of the first node of each order
+static free_node_t *free_lists[MAX_ORDERS]; // one list of free blocks per order
+
+
+/* Function: tree_bits
+ * -------------------
+ * Returns the number of nodes in a split tree whose root has the given
+ * order, which is also the number of bits in each of the bitmaps.
+ */
+static size_t tree_bits(int order) {
+    return ((size_t)2 << (order - MIN_ORDER)) - 1;
+}
+
+/* Function: node_bit
+ * ------------------
+ * Returns the bitmap index of the node of the given order that contains
+ * the given address.
+ */
+static size_t node_bit(int order, char *addr) {
+    return order_base[order] + ((size_t)(addr - arena) >> order);
+}
+
+static bool test_bit(unsigned char *map, size_t bit) {
+    return (map[bit >> 3] >> (bit & 7)) & 1;
+}
+
+static void set_bit(unsigned char *map, size_t bit) {
+    map[bit >> 3] |= 1 << (bit & 7);
+}
+
+static void clear_bit(unsigned char *map, size_t bit) {
+    map[bit >> 3] &= ~(1 << (bit & 7));
+}
+
+/* Function: push_free
+ * -------------------
+ * Marks the block free and pushes it onto the list for its order.
+ */
+static void push_free(int order, char *block) {
+    free_node_t *node = (free_node_t *)block;
+    node->prev = NULL;
+    node->next = free_lists[order];
+    if (node->next != NULL) {
+        node->next->prev = node;
+    }
+    free_lists[order] = node;
+    set_bit(free_bits, node_bit(order, block));
+    clear_bit(split_bits, node_bit(order, block));
+}
+
+/* Function: remove_free
+ * ---------------------
+ * Unlinks the block from the list for its order and clears its free bit.
+ */
+static void remove_free(int order, char *block) {
+    free_node_t *node = (free_node_t *)block;
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        free_lists[order] = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    clear_bit(free_bits, node_bit(order, block));
+}
+
+/* Function: order_for
+ * -------------------
+ * Returns the order of the smallest block that can hold size bytes.
+ */
+static int order_for(size_t size) {
+    if (size <= ((size_t)1 << MIN_ORDER)) {
+        return MIN_ORDER;
+    }
+    return (int)(sizeof(size_t) * 8) - __builtin_clzl(size - 1);
+}
+
+/* Function: block_order
+ * ---------------------
+ * Returns the order of the allocated block starting at ptr, found by
+ * descending from the root through split nodes.
+ */
+static int block_order(char *ptr) {
+    int order = max_order;
+    while (order > MIN_ORDER && test_bit(split_bits, node_bit(order, ptr))) {
+        order--;
+    }
+    return order;
+}
+
+/* Function: split_down
+ * --------------------
+ * Splits the block at the given order down to the target order, keeping
+ * the lower half each time and putting the upper half on its free list.
+ */
+static void split_down(char *block, int order, int target) {
+    while (order > target) {
+        set_bit(split_bits, node_bit(order, block));
+        order--;
+        push_free(order, block + ((size_t)1 << order));
+        clear_bit(free_bits, node_bit(order, block));
+    }
+    clear_bit(split_bits, node_bit(target, block));
+}
+
+/* Function: myinit
+ * ----------------
+ * This function picks the largest power-of-two arena that fits in the
+ * segment along with its two bitmaps, places the bitmaps right after it
+ * and puts the whole arena on the free list as a single block.
+ */
+bool myinit(void *start, size_t size) {
+    if (start == NULL) {
+        return false;
+    }
+
+    int order = MAX_ORDERS - 1;
+    while (order >= MIN_ORDER &&
+           ((size_t)1 << order) + 2 * ((tree_bits(order) + 7) / 8) > size) {
+        order--;
+    }
+    if (order < MIN_ORDER) {
+        return false;
+    }
+
+    nused = 0;
+    arena = start;
+    max_order = order;
+    split_bits = (unsigned char *)arena + ((size_t)1 << max_order);
+    free_bits = split_bits + (tree_bits(max_order) + 7) / 8;
+
+    // Orders are laid out root first, so each order starts after all larger ones
+    size_t base = 0;
+    for (int k = max_order; k >= MIN_ORDER; k--) {
+        order_base[k] = base;
+        base += (size_t)1 << (max_order - k);
+    }
+    memset(free_lists, 0, sizeof(free_lists));
+
+    push_free(max_order, arena);
+    return true;
+}
+
+/* Function: mymalloc
+ * ------------------
+ * This function takes a block from the smallest non-empty order that fits
+ * the request and splits it down to the order of the request.
+ */
+void *mymalloc(size_t requestedsz) {
+    if (requestedsz == 0 || requestedsz > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    int target = order_for(requestedsz);
+    int order = target;
+    while (order <= max_order && free_lists[order] == NULL) {
+        order++;
+    }
+    if (order > max_order) {
+        return NULL;
+    }
+
+    char *block = (char *)free_lists[order];
+    remove_free(order, block);
+    split_down(block, order, target);
+    nused += (size_t)1 << target;
+    return block;
+}
+
+/* Function: myaligned_alloc
+ * -------------------------
+ * A block of order k sits at a multiple of 2^k from the start of the arena,
+ * so this function just asks for a block at least as big as the alignment.
+ * The arena itself is only as aligned as the segment (a page, from mmap),
+ * so a block that still comes back misaligned is given up on.
+ */
+void *myaligned_alloc(size_t alignment, size_t requestedsz) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    if (requestedsz == 0) {
+        return NULL;
+    }
+
+    void *ptr = mymalloc(requestedsz < alignment ? alignment : requestedsz);
+    if (ptr != NULL && ((uintptr_t)ptr & (alignment - 1)) != 0) {
+        myfree(ptr);
+        return NULL;
+    }
+    return ptr;
+}
+
+/* Function: mycalloc
+ * ------------------
+ * This function checks the total size for overflow and zeroes the whole
+ * block, since freed blocks are reused anywhere in the heap.
+ */
+void *mycalloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *ptr = mymalloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+/* Function: mymalloc_batch
+ * ------------------------
+ * This function allocates the blocks one at a time with mymalloc.
+ */
+size_t mymalloc_batch(size_t size, size_t n, void *out[]) {
+    size_t done = 0;
+    for (; done < n; done++) {
+        out[done] = mymalloc(size);
+        if (out[done] == NULL) {
+            break;
+        }
+    }
+    return done;
+}
+
+/* Function: myusable_size
+ * ------------------------
+ * This function returns the size of the block's order, since the whole
+ * power of two belongs to the caller.
+ */
+size_t myusable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    return (size_t)1 << block_order(ptr);
+}
+
+/* Function: myfree
+ * ----------------
+ * This function merges the block with its buddy for as long as the buddy
+ * is a whole free block, then puts the result on its free list.
+ */
+void myfree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    char *block = ptr;
+    int order = block_order(block);
+    nused -= (size_t)1 << order;
+
+    while (order < max_order) {
+        char *buddy = arena + ((size_t)(block - arena) ^ ((size_t)1 << order));
+        if (!test_bit(free_bits, node_bit(order, buddy))) {
+            break;
+        }
+        remove_free(order, buddy);
+        if (buddy < block) {
+            block = buddy;
+        }
+        order++;
+    }
+    push_free(order, block);
+}
+
+/* Function: myfree_sized
+ * ----------------------
+ * The size gives the order of a block from mymalloc or myrealloc, which
+ * splits a shrinking block down to it, but only a lower bound for one from
+ * myaligned_alloc. The split bits below a block are left stale, so they
+ * can't tell the two apart. This function checks the size in debug builds
+ * and then calls myfree, which finds the order from the split bitmap.
+ */
+void myfree_sized(void *ptr, size_t size) {
+    assert(ptr == NULL || size <= myusable_size(ptr)); // size doesn't match the block
+    myfree(ptr);
+}
+
+/* Function: myfree_batch
+ * ----------------------
+ * This function frees the blocks one at a time with myfree, since
+ * each free only looks at the block and its own buddies.
+ */
+void myfree_batch(void *ptrs[], size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        myfree(ptrs[i]);
+    }
+}
+
+/* Function: myrealloc
+ * -------------------
+ * This function shrinks a block by splitting off its upper halves and grows
+ * it in place when it is the lower buddy at every level up to the new order
+ * and all of those buddies are free. Otherwise the payload is moved.
+ */
+void *myrealloc(void *oldptr, size_t newsz) {
+    if (oldptr == NULL) {
+        return mymalloc(newsz);
+    }
+    if (newsz == 0) {
+        myfree(oldptr);
+        return NULL;
+    }
+    if (newsz > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    char *block = oldptr;
+    int order = block_order(block);
+    int target = order_for(newsz);
+
+    if (target <= order) {
+        split_down(block, order, target);
+        nused -= ((size_t)1 << order) - ((size_t)1 << target);
+        return oldptr;
+    }
+
+    // Every ancestor of a block is split, so the buddies checked here are real nodes
+    bool in_place = target <= max_order;
+    for (int k = order; in_place && k < target; k++) {
+        in_place = ((size_t)(block - arena) & ((size_t)1 << k)) == 0 &&
+                   test_bit(free_bits, node_bit(k, block + ((size_t)1 << k)));
+    }
+    if (in_place) {
+        for (int k = order; k < target; k++) {
+            remove_free(k, block + ((size_t)1 << k));
+            clear_bit(split_bits, node_bit(k + 1, block));
+        }
+        nused += ((size_t)1 << target) - ((size_t)1 << order);
+        return oldptr;
+    }
+
+    void *newptr = mymalloc(newsz);
+    if (newptr == NULL) {
+        return NULL;
+    }
+    memcpy(newptr, oldptr, (size_t)1 << order);
+    myfree(oldptr);
+    return newptr;
+}
+
+/* Function: validate_heap
+ * -----------------------
+ * This function walks the split tree to check no two buddies are both free
+ * (they should have merged) and that the allocated bytes match nused, then
+ * walks every free list to check each entry is marked free in the bitmap
+ * and that the lists hold exactly the free leaves of the tree.
+ */
+bool validate_heap() {
+    struct { char *block; int order; } stack[2 * MAX_ORDERS];
+    int depth = 0;
+    size_t used = 0;
+    size_t nfree_tree = 0;
+
+    stack[depth++] = (typeof(stack[0])){ .block = arena, .order = max_order };
+    while (depth > 0) {
+        depth--;
+        char *block = stack[depth].block;
+        int order = stack[depth].order;
+        size_t bit = node_bit(order, block);
+
+        if (order > MIN_ORDER && test_bit(split_bits, bit)) {
+            char *upper = block + ((size_t)1 << (order - 1));
+            if (test_bit(free_bits, bit) ||
+                (test_bit(free_bits, node_bit(order - 1, block)) &&
+                 test_bit(free_bits, node_bit(order - 1, upper)))) {
+                printf("Node %p of order %d is split but free, or has two free halves\n", block, order);
+                breakpoint();
+                return false;
+            }
+            stack[depth++] = (typeof(stack[0])){ .block = block, .order = order - 1 };
+            stack[depth++] = (typeof(stack[0])){ .block = upper, .order = order - 1 };
+        } else if (test_bit(free_bits, bit)) {
+            nfree_tree++;
+        } else {
+            used += (size_t)1 << order;
+        }
+    }
+
+    if (used != nused) {
+        printf("Tree holds %zu allocated bytes but %zu are counted\n", used, nused);
+        breakpoint();
+        return false;
+    }
+
+    size_t nfree_lists = 0;
+    for (int k = MIN_ORDER; k <= max_order; k++) {
+        free_node_t *prev = NULL;
+        for (free_node_t *cur = free_lists[k]; cur != NULL; cur = cur->next) {
+            char *block = (char *)cur;
+            if (((size_t)(block - arena) & (((size_t)1 << k) - 1)) != 0 ||
+                !test_bit(free_bits, node_bit(k, block)) || cur->prev != prev) {
+                printf("Free block %p is misplaced on the order %d list\n", block, k);
+                breakpoint();
+                return false;
+            }
+            prev = cur;
+            nfree_lists++;
+        }
+    }
+
+    if (nfree_lists != nfree_tree) {
+        printf("%zu free leaves in the tree but %zu on lists\n", nfree_tree, nfree_lists);
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+/* Function: dump_heap
+ * -------------------
+ * This function prints the free lists of each order, which is handy to
+ * call from gdb.
+ */
+void dump_heap() {
+    printf("Arena starts at address %p, order %d. %lu bytes currently used.\n",
+        arena, max_order, nused);
+    for (int k = MIN_ORDER; k <= max_order; k++) {
+        if (free_lists[k] != NULL) {
+            printf("order %d:", k);
+            for (free_node_t *cur = free_lists[k]; cur != NULL; cur = cur->next) {
+                printf(" %p", cur);
+            }
+            printf("\n");
+        }
+    }
+}
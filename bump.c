@@ -9,15 +9,27 @@
  * This shows the very simplest of approaches; there are better options!
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "allocator.h"
 #include "debug_break.h"
 
-static void *segment_start;
-static size_t segment_size;
-static size_t nused;
+/* Type: struct heap
+ * ------------------
+ * The state of one heap. heap_create keeps it at the front of the segment
+ * it is given, and defaultHeap is the one behind the mymalloc family.
+ */
+struct heap {
+    void *segment_start;
+    size_t segment_size;
+    size_t nused;
+    size_t ndirty;   // bytes at the start of the segment handed out before the last init
+    struct heap_stats counters;
+};
+
+static heap_t defaultHeap;
 
 
 /* Function: roundup
@@ -29,62 +41,209 @@ size_t roundup(size_t sz, size_t mult) {
     return (sz + mult-1) & ~(mult-1);
 }
 
+/* Function: init_heap
+ * -------------------
+ * This function initializes a heap's variables based on the specified
+ * segment boundary parameters. Re-initializing the same segment remembers
+ * how much of it was handed out before, since heap_calloc has to zero that.
+ */
+static bool init_heap(heap_t *heap, void *start, size_t size) {
+    if (start != heap->segment_start) {
+        heap->ndirty = 0;
+    } else if (heap->nused > heap->ndirty) {
+        heap->ndirty = heap->nused;
+    }
+    heap->segment_start = start;
+    heap->segment_size = size;
+    heap->nused = 0;
+    memset(&heap->counters, 0, sizeof(heap->counters));
+    return true;
+}
+
 /* Function: myinit
  * ----------------
- * This function initializes our global variables based on the specified
- * segment boundary parameters.
+ * This function initializes the default heap to the specified segment.
  */
 bool myinit(void *start, size_t size) {
-    segment_start = start;
-    segment_size = size;
-    nused = 0;
-    return true;
+    return init_heap(&defaultHeap, start, size);
 }
 
-/* Function: mymalloc
- * ------------------
+/* Function: heap_create
+ * ---------------------
+ * This function places a heap's variables at the front of the segment
+ * and bumps through whatever is left after them.
+ */
+heap_t *heap_create(void *start, size_t size) {
+    size_t state = roundup(sizeof(heap_t), ALIGNMENT);
+    if (start == NULL || size < state) {
+        return NULL;
+    }
+    heap_t *heap = start;
+    init_heap(heap, (char *)start + state, size - state);
+    return heap;
+}
+
+/* Function: bump_block
+ * --------------------
+ * This function places a block of the requested size at the end of the
+ * heap, without counting it as a malloc so that myrealloc can share it.
+ */
+static void *bump_block(heap_t *heap, size_t requestedsz) {
+    size_t needed = roundup(requestedsz, ALIGNMENT);
+    if (needed + heap->nused > heap->segment_size) {
+        return NULL;
+    }
+    void *ptr = (char *)heap->segment_start + heap->nused;
+    heap->nused += needed;
+    return ptr;
+}
+
+/* Function: heap_malloc
+ * ---------------------
  * This function satisfies an allocation request by placing
  * the allocated block at the end of the heap.  No search means
  * it is fast, but no memory recycling means very poor utilization.
  */
-void *mymalloc(size_t requestedsz) {
+void *heap_malloc(heap_t *heap, size_t requestedsz) {
+    void *ptr = bump_block(heap, requestedsz);
+    if (ptr != NULL) {
+        heap->counters.mallocs++;
+    }
+    return ptr;
+}
+
+/* Function: heap_aligned_alloc
+ * ----------------------------
+ * This function bumps the end of the heap up to the next multiple of
+ * alignment before placing the block there. The skipped bytes are simply
+ * lost, like everything else this allocator frees.
+ */
+void *heap_aligned_alloc(heap_t *heap, size_t alignment, size_t requestedsz) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    size_t start = roundup((uintptr_t)heap->segment_start + heap->nused, alignment) - (uintptr_t)heap->segment_start;
     size_t needed = roundup(requestedsz, ALIGNMENT);
-    if (needed + nused > segment_size) {
+    if (start + needed > heap->segment_size) {
+        return NULL;
+    }
+    heap->nused = start + needed;
+    heap->counters.mallocs++;
+    return (char *)heap->segment_start + start;
+}
+
+/* Function: heap_calloc
+ * ---------------------
+ * This function never hands out the same bytes twice, so a new block is
+ * still zero from mmap unless it overlaps what was handed out before the
+ * segment was last re-initialized.
+ */
+void *heap_calloc(heap_t *heap, size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    size_t total = nmemb * size;
+    char *ptr = heap_malloc(heap, total);
+    if (ptr == NULL) {
         return NULL;
     }
-    void *ptr = (char *)segment_start + nused;
-    nused += needed;
+    size_t offset = ptr - (char *)heap->segment_start;
+    if (offset < heap->ndirty) {
+        memset(ptr, 0, heap->ndirty - offset < total ? heap->ndirty - offset : total);
+    }
     return ptr;
 }
 
-/* Function: myfree
- * ----------------
+/* Function: heap_malloc_batch
+ * ---------------------------
+ * This function allocates the blocks one at a time with heap_malloc, which is
+ * already a single bump of the end pointer.
+ */
+size_t heap_malloc_batch(heap_t *heap, size_t size, size_t n, void *out[]) {
+    size_t done = 0;
+    for (; done < n; done++) {
+        out[done] = heap_malloc(heap, size);
+        if (out[done] == NULL) {
+            break;
+        }
+    }
+    return done;
+}
+
+/* Function: heap_usable_size
+ * --------------------------
+ * Blocks carry no size, so this function can't tell how big one is and
+ * returns 0.
+ */
+size_t heap_usable_size(heap_t *heap, void *ptr) {
+    return 0;
+}
+
+/* Function: heap_free
+ * -------------------
  * This function does nothing - fast!... but lame :(
+ * It only counts the call for heap_stats.
+ */
+void heap_free(heap_t *heap, void *ptr) {
+    if (ptr != NULL) {
+        heap->counters.frees++;
+    }
+}
+
+/* Function: heap_free_sized
+ * -------------------------
+ * This function does nothing either, like heap_free.
  */
-void myfree(void *ptr) {}
+void heap_free_sized(heap_t *heap, void *ptr, size_t size) {
+    heap_free(heap, ptr);
+}
 
-/* Function: realloc
- * -----------------
+/* Function: heap_free_batch
+ * -------------------------
+ * This function does nothing either, past counting each pointer.
+ */
+void heap_free_batch(heap_t *heap, void *ptrs[], size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        heap_free(heap, ptrs[i]);
+    }
+}
+
+/* Function: heap_realloc
+ * ----------------------
  * This function satisfies requests for resizing previously-allocated memory
  * blocks by allocating a new block of the requested size and moving the
  * existing contents to that region.  It's not particularly efficient.
  */
-void *myrealloc(void *oldptr, size_t newsz) {
-    void *newptr = mymalloc(newsz);
+void *heap_realloc(heap_t *heap, void *oldptr, size_t newsz) {
+    void *newptr = bump_block(heap, newsz);
     memcpy(newptr, oldptr, newsz);
-    myfree(oldptr);
+    heap->counters.reallocs++;
+    heap->counters.reallocs_moved++;
     return newptr;
 }
 
-/* Function: validate_heap
+/* Function: heap_stats
+ * --------------------
+ * This function reports the counters kept so far. Nothing is ever
+ * recycled, so the only free block is whatever is left past the end.
+ */
+void heap_stats(heap_t *heap, struct heap_stats *stats) {
+    *stats = heap->counters;
+    stats->bytes_in_use = heap->nused;
+    stats->bytes_free = heap->segment_size - heap->nused;
+    stats->free_blocks = heap->nused < heap->segment_size ? 1 : 0;
+    stats->largest_free = heap->segment_size - heap->nused;
+}
+
+/* Function: heap_validate
  * -----------------------
  * This function checks for potential errors/inconsistencies in the heap data
  * structures and returns false if there were issues, or true otherwise.
  * This implementation checks if the allocator has used more space than is
  * available.
  */
-bool validate_heap() {
-    if (nused > segment_size) {
+bool heap_validate(heap_t *heap) {
+    if (heap->nused > heap->segment_size) {
         printf("Oops! Have used more heap than total available?!\n");
         breakpoint();   // call this function to stop in gdb to poke around
         return false;
@@ -107,13 +266,65 @@ bool validate_heap() {
  * which would be less overwhelming to wade through for debugging.
  */
 void dump_heap() {
+    heap_t *heap = &defaultHeap;
     printf("Heap segment starts at address %p, ends at %p. %lu bytes currently used.", 
-        segment_start, (char *)segment_start + segment_size, nused);
-    for (int i = 0; i < nused; i++) {
-        unsigned char *cur = (unsigned char *)segment_start + i;
+        heap->segment_start, (char *)heap->segment_start + heap->segment_size, heap->nused);
+    for (int i = 0; i < heap->nused; i++) {
+        unsigned char *cur = (unsigned char *)heap->segment_start + i;
         if (i % 32 == 0) {
             printf("\n%p: ", cur);
         }
         printf("%02x ", *cur);
     }
 }
+
+/* Functions: mymalloc, myaligned_alloc, mycalloc, mymalloc_batch,
+ *            myrealloc, myusable_size, myfree, myfree_sized,
+ *            myfree_batch, mystats, validate_heap
+ * ----------------------------------------------------------------
+ * These functions do the same as their heap_ counterparts on the default
+ * heap set up by myinit.
+ */
+void *mymalloc(size_t requestedsz) {
+    return heap_malloc(&defaultHeap, requestedsz);
+}
+
+void *myaligned_alloc(size_t alignment, size_t requestedsz) {
+    return heap_aligned_alloc(&defaultHeap, alignment, requestedsz);
+}
+
+void *mycalloc(size_t nmemb, size_t size) {
+    return heap_calloc(&defaultHeap, nmemb, size);
+}
+
+size_t mymalloc_batch(size_t size, size_t n, void *out[]) {
+    return heap_malloc_batch(&defaultHeap, size, n, out);
+}
+
+void *myrealloc(void *oldptr, size_t newsz) {
+    return heap_realloc(&defaultHeap, oldptr, newsz);
+}
+
+size_t myusable_size(void *ptr) {
+    return heap_usable_size(&defaultHeap, ptr);
+}
+
+void myfree(void *ptr) {
+    heap_free(&defaultHeap, ptr);
+}
+
+void myfree_sized(void *ptr, size_t size) {
+    heap_free_sized(&defaultHeap, ptr, size);
+}
+
+void myfree_batch(void *ptrs[], size_t n) {
+    heap_free_batch(&defaultHeap, ptrs, n);
+}
+
+void mystats(struct heap_stats *stats) {
+    heap_stats(&defaultHeap, stats);
+}
+
+bool validate_heap() {
+    return heap_validate(&defaultHeap);
+}
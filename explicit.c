@@ -1,140 +1,721 @@
 #include "allocator.h"
 #include "debug_break.h"
+#include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#if defined(PERCPU_CACHE) && defined(__x86_64__) && defined(__linux__)
+#include <sys/rseq.h>
+#define USE_RSEQ
+#endif
+#endif
 
 /* 
   EXPLICIT HEAP IMPLEMENTATION 
   This allocator uses an explicit free list design where free blocks are
-  organized in a doubly-linked list for efficient free space management.
+  organized in doubly-linked lists for efficient free space management.
   The heap maintains both allocated and free blocks with comprehensive
   header information and implements coalescing for fragmentation reduction. 
   You can find more detailed information of the implementation on the readme file. 
  
   Block Format:
-  - Header (24 bytes): Contains payload size, allocation bit (LSB), and
-    doubly-linked list pointers (prev/next) for free blocks
-  - Payload: User data space (8-byte aligned) 
+  - Header (8 bytes): Contains payload size and allocation bit (LSB)
+  - Payload: User data space (8-byte aligned, at least 24 bytes). While the
+    block is free, its first two words hold the doubly-linked list pointers
+    (prev/next), or the tree links for large blocks 
+  - Footer (8 bytes, free blocks only): a copy of the payload size stored in
+    the last word of the block, so the right neighbour can find our header 
+  - Bit 1 of the header (PREV_FREE_BIT) records whether the block to the left
+    is free, which tells myfree when it may trust the footer in front of it 
 
   Free List Management:
-    - Doubly-linked list of free blocks pointed to by freeEnd
-    - LIFO insertion strategy (new free blocks added to front)
-    - Coalescing with immediate right neighbor during deallocation
+    - Segregated free lists: freeLists[i] holds the free blocks whose payload
+      lies in [2^(i+3), 2^(i+4)), so each size class is a power-of-two range
+    - mymalloc starts at the size class of the request, and any block in a
+      higher class is guaranteed to fit, so the search is near-constant time
+    - LIFO insertion strategy (new free blocks added to front of their class)
+    - Free blocks of LARGE_BLOCK bytes or more are kept in largeTree instead,
+      an AVL tree ordered by (size, address) whose nodes live inside the free
+      blocks, so large requests get the best fit in O(log n)
+    - Coalescing with both the left and right neighbours during deallocation,
+      so no two free blocks are ever adjacent
+
+  Building with -DTHREAD_SAFE puts a lock in each heap and a small cache of
+  freed slab objects in each thread (see THREAD CACHE below). Without it the
+  heap_ functions call straight into the unlocked code. 
  */ 
 
 
-// Global state variables 
-static void *heapStart; // Pointer to the beginning of heap region 
-static size_t heapSize; // Total size of heap in bytes 
-static size_t sizeUsed; // Total bytes currently being used (includes header)
-static void *freeEnd; // Pointer to the head of the first free block 
-static size_t freeSpace; // Total bytes available for allocation 
+// Free blocks with at least this much payload go in the tree rather than the lists 
+#define LARGE_BLOCK 1024
+
+// Number of segregated size classes (enough to cover payloads below LARGE_BLOCK)
+#define NUM_LISTS 7
+
+// Number of payload sizes the lists can hold, one per multiple of 8 below LARGE_BLOCK 
+#define NUM_LIST_SIZES (LARGE_BLOCK / 8)
+
+// Status bits kept in the low bits of the header word 
+#define ALLOC_BIT 1
+#define PREV_FREE_BIT 2
+#define SIZE_MASK (~(size_t)7)
+
+// Slab pages and the object sizes they serve (see SLAB FRONT-END below) 
+#define SLAB_SIZE 4096
+#define SLAB_SHIFT 12
+#define SLAB_MAX_OBJECT 256
+#define NUM_SLAB_CLASSES 10
+
+// Allocated blocks only carry the size/status word; prev/next live in the payload of free blocks 
+#define HEADER_SIZE 8
+
+// Smallest payload that can hold the prev/next pointers and the footer once freed 
+#define MIN_PAYLOAD 24
+
+// Smallest block that can stand on its own as a free block 
+#define MIN_BLOCK (HEADER_SIZE + MIN_PAYLOAD)
 
-// TYPE DELCARATION FOR STRUCT
+// TYPE DELCARATION FOR STRUCT (only h is present on allocated blocks) 
 typedef struct {
     size_t h; // payload size with status bit 
-    size_t *prev; // previous free block 
-    size_t *next; // next free block 
+    size_t *prev; // previous free block, first word of the payload 
+    size_t *next; // next free block, second word of the payload 
 } curr_header;
 
+// Layout of a large free block while it sits in the tree 
+typedef struct tree_node {
+    size_t h; // payload size (free, so no status bits set) 
+    struct tree_node *left; // smaller (size, address) keys 
+    struct tree_node *right; // larger (size, address) keys 
+    size_t height; // height of the subtree rooted here, 1 for a leaf 
+} tree_node;
+
+// State of one heap, which heap_create keeps at the front of its segment 
+struct heap {
+    void *heapStart; // Pointer to the beginning of heap region 
+    size_t heapSize; // Total size of heap in bytes 
+    size_t sizeUsed; // Total bytes currently being used (includes header)
+    size_t *freeLists[NUM_LISTS]; // Heads of the segregated free lists 
+    size_t listSizeCounts[NUM_LIST_SIZES]; // Number of listed free blocks of each payload size, indexed by size / 8 
+    uint64_t listSizeBits[NUM_LIST_SIZES / 64]; // Bit size / 8 is set while some listed free block has that payload 
+    size_t freeSpace; // Total bytes available for allocation 
+    unsigned char *zeroMark; // Nothing at or above this address has ever been written 
+    struct heap_stats counters; // Running totals reported by heap_stats 
+    tree_node *largeTree; // Root of the tree of large free blocks 
+    unsigned char *pageMap; // Size class + 1 of each slab page, 0 for other pages 
+    struct slab_header *partialSlabs[NUM_SLAB_CLASSES]; // Slabs with at least one free object 
+#ifdef THREAD_SAFE
+    pthread_mutex_t lock; // Held by any thread touching the state above 
+    size_t generation; // Changes each time the heap is reset, so thread caches can tell they are stale 
+    void *remoteFrees; // Stack of blocks freed by other threads, linked through their first word 
+#endif
+};
+
+#ifdef THREAD_SAFE
+// Last generation handed out, shared by all heaps since a new one may reuse an old one's address 
+static size_t lastGeneration;
+#endif
+
 // This function rounds up a number to the nearest multiple of 8 for alignment 
 size_t roundup(size_t number) {
     return (number + 8 - 1) & ~(8 - 1); 
 }
 
+// This function maps a payload size to the index of its segregated free list 
+static size_t sizeClass(size_t payload) {
+    // floor(log2(payload)) - 3, so payloads of 8-15 bytes land in class 0 
+    size_t index = (sizeof(size_t) * 8 - 1) - __builtin_clzl(payload) - 3;
+    return index < NUM_LISTS ? index : NUM_LISTS - 1;
+}
+
+// This function orders tree nodes by size, breaking ties by address 
+static bool nodeLess(tree_node *a, tree_node *b) {
+    return a->h < b->h || (a->h == b->h && a < b);
+}
+
+// This function returns the height of a subtree, 0 for an empty one 
+static size_t nodeHeight(tree_node *node) {
+    return node != NULL ? node->height : 0;
+}
+
+// This function recomputes a node's height from its children 
+static void fixHeight(tree_node *node) {
+    size_t left = nodeHeight(node->left);
+    size_t right = nodeHeight(node->right);
+    node->height = (left > right ? left : right) + 1;
+}
+
+// This function rotates a subtree to the right and returns its new root 
+static tree_node *rotateRight(tree_node *node) {
+    tree_node *root = node->left;
+    node->left = root->right;
+    root->right = node;
+    fixHeight(node);
+    fixHeight(root);
+    return root;
+}
+
+// This function rotates a subtree to the left and returns its new root 
+static tree_node *rotateLeft(tree_node *node) {
+    tree_node *root = node->right;
+    node->right = root->left;
+    root->left = node;
+    fixHeight(node);
+    fixHeight(root);
+    return root;
+}
+
+// This function restores the AVL balance of a subtree whose children are balanced, returning its new root 
+static tree_node *rebalance(tree_node *node) {
+    fixHeight(node);
+    if (nodeHeight(node->left) > nodeHeight(node->right) + 1) {
+        if (nodeHeight(node->left->right) > nodeHeight(node->left->left)) {
+            node->left = rotateLeft(node->left);
+        }
+        return rotateRight(node);
+    }
+    if (nodeHeight(node->right) > nodeHeight(node->left) + 1) {
+        if (nodeHeight(node->right->left) > nodeHeight(node->right->right)) {
+            node->right = rotateRight(node->right);
+        }
+        return rotateLeft(node);
+    }
+    return node;
+}
+
+// This function adds a free block to a subtree and returns its new root 
+static tree_node *treeInsert(tree_node *root, tree_node *node) {
+    if (root == NULL) {
+        node->left = NULL;
+        node->right = NULL;
+        node->height = 1;
+        return node;
+    }
+    if (nodeLess(node, root)) {
+        root->left = treeInsert(root->left, node);
+    } else {
+        root->right = treeInsert(root->right, node);
+    }
+    return rebalance(root);
+}
+
+// This function detaches the smallest node of a subtree into *min and returns the new root 
+static tree_node *treeRemoveMin(tree_node *root, tree_node **min) {
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = treeRemoveMin(root->left, min);
+    return rebalance(root);
+}
+
+// This function removes a free block from a subtree and returns its new root 
+static tree_node *treeRemove(tree_node *root, tree_node *node) {
+    if (root == node) {
+        if (root->right == NULL) {
+            return root->left;
+        }
+        // Replaces the node with its in-order successor 
+        tree_node *successor;
+        tree_node *right = treeRemoveMin(root->right, &successor);
+        successor->left = root->left;
+        successor->right = right;
+        return rebalance(successor);
+    }
+    if (nodeLess(node, root)) {
+        root->left = treeRemove(root->left, node);
+    } else {
+        root->right = treeRemove(root->right, node);
+    }
+    return rebalance(root);
+}
+
+// This function returns the smallest large free block with at least the requested payload 
+static tree_node *treeBestFit(heap_t *heap, size_t requested_size) {
+    tree_node *best = NULL;
+    tree_node *current = heap->largeTree;
+    while (current != NULL) {
+        if (current->h >= requested_size) {
+            best = current; // fits, but a smaller one may lie to the left 
+            current = current->left;
+        } else {
+            current = current->right;
+        }
+    }
+    return best;
+}
+
+// This function files a free block in the tree or the list for its size class and writes its footer 
+static void insertFree(heap_t *heap, size_t *block) {
+    curr_header *mystruct = (curr_header *)block;
+    *(size_t *)((unsigned char *)block + HEADER_SIZE + mystruct->h - sizeof(size_t)) = mystruct->h;
+    heap->counters.free_blocks++;
+    if (mystruct->h >= LARGE_BLOCK) {
+        heap->largeTree = treeInsert(heap->largeTree, (tree_node *)block);
+        return;
+    }
+
+    // Counting blocks by exact size keeps the largest listed size a bit scan away 
+    size_t slot = mystruct->h >> 3;
+    if (heap->listSizeCounts[slot]++ == 0) {
+        heap->listSizeBits[slot >> 6] |= (uint64_t)1 << (slot & 63);
+    }
+
+    // Small blocks are pushed onto the front of their list 
+    size_t index = sizeClass(mystruct->h);
+
+    mystruct->prev = NULL;
+    mystruct->next = heap->freeLists[index];
+    if (heap->freeLists[index] != NULL) {
+        ((curr_header *)heap->freeLists[index])->prev = block;
+    }
+    heap->freeLists[index] = block;
+}
+
+// This function takes a free block out of the tree or unlinks it from the list for its size class 
+static void removeFree(heap_t *heap, size_t *block) {
+    curr_header *mystruct = (curr_header *)block;
+    heap->counters.free_blocks--;
+    if (mystruct->h >= LARGE_BLOCK) {
+        heap->largeTree = treeRemove(heap->largeTree, (tree_node *)block);
+        return;
+    }
+
+    size_t slot = mystruct->h >> 3;
+    if (--heap->listSizeCounts[slot] == 0) {
+        heap->listSizeBits[slot >> 6] &= ~((uint64_t)1 << (slot & 63));
+    }
+    if (mystruct->prev != NULL) {
+        ((curr_header *)mystruct->prev)->next = mystruct->next;
+    } else { 
+        // This was the first free block of its class, update the list head 
+        heap->freeLists[sizeClass(mystruct->h)] = mystruct->next;
+    }
+    if (mystruct->next != NULL) {
+        ((curr_header *)mystruct->next)->prev = mystruct->prev;
+    }
+}
+
 // This function splits up a free block if it's significantly larger than the requested size. 
-void splitFunc(size_t *currentFree, size_t *used, size_t *payload, size_t requested_size) {
+void splitFunc(heap_t *heap, size_t *currentFree, size_t *used, size_t *payload, size_t requested_size) {
     /* - Splits a free block into an allocated block and a remaining free one 
-       - Creates a new free block from the remaining space. 
+       - Creates a new free block from the remaining space and files it under
+         the size class of the remainder (which may differ from the original)
     */     
-    
-    curr_header split;
-    curr_header mystruct = *(curr_header *)currentFree; 
+    removeFree(heap, currentFree);
 
     // Calculates the address where the new free block will start 
-    unsigned char *split_address = (unsigned char *)currentFree + 16 + requested_size; 
+    unsigned char *split_address = (unsigned char *)currentFree + HEADER_SIZE + requested_size; 
 
     // Initializes the header of the new free block 
-    split.h = *payload - (requested_size + 16); // remaining free space 
-    split.prev = mystruct.prev;
-    split.next = mystruct.next;
-    *(curr_header *)split_address = split; 
+    ((curr_header *)split_address)->h = *payload - (requested_size + HEADER_SIZE); // remaining free space 
+    insertFree(heap, (size_t *)split_address);
+    heap->counters.splits++;
 
     // Sets the size of the allocated block 
-    *used = 16 + requested_size;
+    *used = HEADER_SIZE + requested_size;
     *payload = requested_size;
+}
 
-    // Modifies the next and previous struct to update the double-linked free list pointers
-    if (mystruct.next != NULL) {
-        curr_header nextStruct = *(curr_header *)mystruct.next;
-        nextStruct.prev = (size_t *)split_address;
-        *(curr_header *)mystruct.next = nextStruct;
+// This function removes a free block from the list without splitting, called when you can't efficiently split the block
+void cantSplit(heap_t *heap, size_t *used, size_t *currentFree, size_t payload){ 
+    *used = HEADER_SIZE + payload; 
+    removeFree(heap, currentFree);
+} 
+
+// This function finds a free block that can hold the requested size, or NULL if there is none 
+static size_t *findFree(heap_t *heap, size_t requested_size) {
+    // Large requests can only be met from the tree 
+    if (requested_size >= LARGE_BLOCK) {
+        return (size_t *)treeBestFit(heap, requested_size);
+    }
+    size_t index = sizeClass(requested_size);
+
+    // Blocks in the request's own class may still be too small, so search it first-fit 
+    for (size_t *current = heap->freeLists[index]; current != NULL; current = ((curr_header *)current)->next) {
+        if (requested_size <= ((curr_header *)current)->h) {
+            return current;
+        }
+    }
+
+    // Every block in a higher class is larger than the request, so take the first one found 
+    for (index++; index < NUM_LISTS; index++) {
+        if (heap->freeLists[index] != NULL) {
+            return heap->freeLists[index];
+        }
     }
-    if (mystruct.prev != NULL) {
-        curr_header prevStruct = *(curr_header *)mystruct.prev;
-        prevStruct.next = (size_t *)split_address;
-        *(curr_header *)mystruct.prev = prevStruct;                
-    } else if (mystruct.prev  == NULL) { 
-        // If this was the first free block, update the free list header 
-        freeEnd = split_address;
+
+    // Falls back to the smallest large block 
+    return (size_t *)treeBestFit(heap, requested_size);
+}
+
+// This function raises the high-water mark past an allocated block and the free block header that may follow it 
+static void raiseMark(heap_t *heap, unsigned char *header) {
+    /* - Past the highest allocated block there is only the last free block, whose
+         header and links fill the first MIN_BLOCK bytes after the allocated one 
+       - Its footer sits in the last word of the heap, which the mark only covers
+         once an allocated block reaches the end of the heap 
+    */ 
+    unsigned char *end = header + HEADER_SIZE + (((curr_header *)header)->h & SIZE_MASK) + MIN_BLOCK;
+    if (end > heap->zeroMark) {
+        heap->zeroMark = end;
     }
 }
 
-// This function removes a free block from the list without splitting, called when you can't efficiently split the block
-void cantSplit(size_t *used, size_t *currentFree, size_t payload){ 
-    curr_header mystruct = *(curr_header *)currentFree;
-    *used = 16 + payload; 
-
-    // Remove this block from the doubly-linked list 
-    if (mystruct.prev != NULL) {
-        curr_header prevStruct = *(curr_header *)mystruct.prev;
-        prevStruct.next = mystruct.next;
-        *(curr_header *)mystruct.prev = prevStruct;
+// This function carves the requested size out of a free block and marks it as allocated 
+static void *allocateBlock(heap_t *heap, size_t *currentFree, size_t requested_size) {
+    curr_header *mystruct = (curr_header *)currentFree;
+    size_t payload = mystruct->h;
+    size_t used;
+
+    //Split the block is there is enough free space left over 
+    if ((payload - requested_size) >= MIN_BLOCK) {
+        splitFunc(heap, currentFree, &used, &payload, requested_size);
     } else { 
-        // This was the first free block 
-        freeEnd = mystruct.next; // updates the free list head 
-    } 
+        // Use the entire block without splitting 
+        cantSplit(heap, &used, currentFree, payload);
+    }
+
+    // Updates the heap's counter variables 
+    heap->sizeUsed += used;
+    heap->freeSpace -= used; 
 
-    if (mystruct.next != NULL) {
-        curr_header nextStruct = *(curr_header *)mystruct.next;
-        nextStruct.prev = mystruct.prev;
-        *(curr_header *)mystruct.next = nextStruct;
-    } else if (mystruct.next == NULL && mystruct.prev != NULL) { 
-        // This was the last block, update the free list head to previous 
-        freeEnd = mystruct.prev;
-    } else if (mystruct.next == NULL && mystruct.prev == NULL) { 
-        // This was the only free block and the free list is now empty 
-        freeEnd = NULL;
+    // Marks the block as allocated by setting the status bit 
+    mystruct->h = payload | ALLOC_BIT;
+
+    // If the whole block was used, its right neighbour no longer follows a free block 
+    unsigned char *nextAddress = (unsigned char *)currentFree + HEADER_SIZE + payload;
+    if (nextAddress < (unsigned char *)heap->heapStart + heap->heapSize) {
+        ((curr_header *)nextAddress)->h &= ~PREV_FREE_BIT;
     }
-} 
+    raiseMark(heap, (unsigned char *)currentFree);
 
-// This function initializes the heap allocator 
-bool myinit(void *heap_start, size_t heap_size) {
+    // Returns a pointer to the payload 
+    return (unsigned char *)currentFree + HEADER_SIZE;
+}
+
+// This function gives the part of an allocated block beyond requested_size back to the free lists 
+static void releaseTail(heap_t *heap, unsigned char *header, size_t requested_size) {
+    size_t h = ((curr_header *)header)->h;
+    size_t payload = h & SIZE_MASK;
+    size_t surplus = payload - requested_size;
+    unsigned char *nextAddress = header + HEADER_SIZE + payload;
+    bool nextFree = nextAddress < (unsigned char *)heap->heapStart + heap->heapSize && (((curr_header *)nextAddress)->h & ALLOC_BIT) == 0;
+
+    // Only split if the leftover can stand on its own as a free block or be merged into a free neighbour 
+    if (surplus == 0 || (!nextFree && surplus < MIN_BLOCK)) {
+        return;
+    }
+
+    unsigned char *split_address = header + HEADER_SIZE + requested_size;
+    size_t split_payload = surplus - HEADER_SIZE; // remaining free space 
+    if (nextFree) {
+        // Coalesces the leftover with the free right neighbour 
+        size_t next_payload = ((curr_header *)nextAddress)->h;
+        removeFree(heap, (size_t *)nextAddress);
+        split_payload += (HEADER_SIZE + next_payload);
+        heap->counters.coalesces++;
+    } else if (nextAddress < (unsigned char *)heap->heapStart + heap->heapSize) {
+        // The block after the leftover now follows a free block 
+        ((curr_header *)nextAddress)->h |= PREV_FREE_BIT;
+    }
+    ((curr_header *)split_address)->h = split_payload;
+    insertFree(heap, (size_t *)split_address);
+    heap->counters.splits++;
+
+    // Shrinks the allocated block while keeping its status bits 
+    ((curr_header *)header)->h = requested_size | (h & ~SIZE_MASK);
+    heap->sizeUsed -= surplus;
+    heap->freeSpace += surplus;
+}
+
+// This function frees a general (non-slab) block of memory and coalesces with both neighbours 
+static void freeBlock(heap_t *heap, void *ptr) { 
+    if (ptr != NULL) { 
+        //Gets the header of the block being freed 
+        unsigned char *header = (unsigned char *)ptr - HEADER_SIZE;
+        size_t h = ((curr_header *)header)->h;
+        size_t payload = h & SIZE_MASK; // clears the status bits to get actual payload size 
+        unsigned char *heapEnd = (unsigned char *)heap->heapStart + heap->heapSize;
+
+        // Updates the heap's counters 
+        heap->sizeUsed -= (payload + HEADER_SIZE);
+        heap->freeSpace += (payload + HEADER_SIZE);
+
+        // Coalesces with right neighbour if its free (prevents reading beyond the bounds of the heap) 
+        unsigned char *nextAddress = (unsigned char *)ptr + payload; 
+        if (nextAddress < heapEnd && (((curr_header *)nextAddress)->h & ALLOC_BIT) == 0) {
+            size_t next_payload = ((curr_header *)nextAddress)->h;
+            removeFree(heap, (size_t *)nextAddress);
+            payload += (HEADER_SIZE + next_payload);
+            heap->counters.coalesces++;
+        }
+
+        // Coalesces with left neighbour if its free, finding its header through its footer 
+        if (h & PREV_FREE_BIT) {
+            size_t prev_payload = *(size_t *)(header - sizeof(size_t));
+            header -= (HEADER_SIZE + prev_payload);
+            removeFree(heap, (size_t *)header);
+            payload += (HEADER_SIZE + prev_payload);
+            heap->counters.coalesces++;
+        }
+
+        // The merged block may belong to a larger size class, so it is filed by its new size 
+        ((curr_header *)header)->h = payload; // Mark as free 
+        insertFree(heap, (size_t *)header);
+
+        // Lets the block to the right know that its left neighbour is now free 
+        nextAddress = header + HEADER_SIZE + payload;
+        if (nextAddress < heapEnd) {
+            ((curr_header *)nextAddress)->h |= PREV_FREE_BIT;
+        }
+    }
+}
+
+// This function carves a block whose payload starts offset bytes past a multiple of alignment (a power of two) 
+static void *allocateAligned(heap_t *heap, size_t requested_size, size_t alignment, size_t offset) {
+    // Asks for enough room to skip past any misaligned prefix and still leave a free block in front 
+    size_t *currentFree = findFree(heap, requested_size + alignment + MIN_BLOCK);
+    if (currentFree == NULL) {
+        return NULL;
+    }
+    unsigned char *block = (unsigned char *)currentFree;
+    unsigned char *ptr = block + HEADER_SIZE;
+
+    // The prefix in front of the aligned payload must be empty or big enough to be a free block 
+    unsigned char *aligned = (unsigned char *)((((uintptr_t)ptr - offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) + offset);
+    while (aligned != ptr && (size_t)(aligned - ptr) < MIN_BLOCK) {
+        aligned += alignment;
+    }
+
+    // Takes only the prefix and the request, so whatever lies past them stays free 
+    size_t prefix = aligned - ptr;
+    allocateBlock(heap, currentFree, prefix + requested_size);
+    size_t payload = ((curr_header *)block)->h & SIZE_MASK;
+
+    if (prefix != 0) {
+        // Gives the prefix back as a free block, whose left neighbour is allocated like ours was 
+        unsigned char *header = aligned - HEADER_SIZE;
+        ((curr_header *)header)->h = (payload - prefix) | ALLOC_BIT | PREV_FREE_BIT;
+        ((curr_header *)block)->h = prefix - HEADER_SIZE;
+        insertFree(heap, (size_t *)block);
+        heap->sizeUsed -= prefix;
+        heap->freeSpace += prefix;
+        heap->counters.splits++;
+    }
+    return aligned;
+}
+
+/* 
+  SLAB FRONT-END 
+  Requests of up to SLAB_MAX_OBJECT bytes are served from slabs: general
+  blocks whose header sits at the start of a page and which fill exactly
+  that page, each holding objects of a single size class. Slabs can then
+  be packed back to back without misaligned gaps between them. Objects
+  carry no header of their own. A slab keeps a singly-linked list of its
+  free objects, and each class keeps a list of its slabs that still have
+  room. The page map (one byte per page, stored past the end of the heap)
+  holds the size class of each slab page plus one, or 0 for other pages,
+  which is how myfree tells a slab object apart from a general block and
+  how myrealloc learns its size without reading the slab header. A slab
+  that becomes empty goes back to the general heap unless it is the only
+  slab left in its class.
+ */ 
+
+// Object size of each slab class 
+static const size_t slabSizes[NUM_SLAB_CLASSES] = {8, 16, 24, 32, 48, 64, 96, 128, 192, 256};
+
+// Slab class for each request size, indexed by size / 8. It is constant so 
+// re-initializing a heap never writes what other threads' slab allocations read 
+static const unsigned char slabClassOf[SLAB_MAX_OBJECT / 8 + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5,  // 0 to 64 bytes 
+    6, 6, 6, 6, 7, 7, 7, 7,     // 72 to 128 bytes 
+    8, 8, 8, 8, 8, 8, 8, 8,     // 136 to 192 bytes 
+    9, 9, 9, 9, 9, 9, 9, 9      // 200 to 256 bytes 
+};
+
+// Header at the start of each slab's payload, right after the general block header 
+typedef struct slab_header {
+    struct slab_header *next; // next slab of this class with free objects 
+    struct slab_header *prev; // previous slab of this class with free objects 
+    void *freeObjects; // singly-linked list of free objects in this slab 
+    unsigned int sizeClass; // index into slabSizes 
+    unsigned int numFree; // number of objects on freeObjects 
+} slab_header;
+
+// This function returns the number of objects that fit in a slab of the given class 
+static unsigned int slabCapacity(size_t index) {
+    return (SLAB_SIZE - HEADER_SIZE - sizeof(slab_header)) / slabSizes[index];
+}
+
+// This function returns the page map entry for the page holding ptr 
+static unsigned char *pageEntry(heap_t *heap, void *ptr) {
+    return &heap->pageMap[((uintptr_t)ptr >> SLAB_SHIFT) - ((uintptr_t)heap->heapStart >> SLAB_SHIFT)];
+}
+
+// This function checks whether ptr lies in a slab page 
+static bool isSlabObject(heap_t *heap, void *ptr) {
+    return *pageEntry(heap, ptr) != 0;
+}
+
+// This function returns the header of the slab holding a slab object 
+static slab_header *slabOf(void *ptr) {
+    return (slab_header *)(((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1)) + HEADER_SIZE);
+}
+
+// This function links a slab onto the front of its class's list of slabs with room 
+static void pushPartial(heap_t *heap, slab_header *slab) {
+    slab->prev = NULL;
+    slab->next = heap->partialSlabs[slab->sizeClass];
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    heap->partialSlabs[slab->sizeClass] = slab;
+}
+
+// This function unlinks a slab from its class's list of slabs with room 
+static void removePartial(heap_t *heap, slab_header *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        heap->partialSlabs[slab->sizeClass] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// This function carves a new slab for a size class from the general heap 
+static slab_header *newSlab(heap_t *heap, size_t index) {
+    slab_header *slab = allocateAligned(heap, SLAB_SIZE - HEADER_SIZE, SLAB_SIZE, HEADER_SIZE);
+    if (slab == NULL) {
+        return NULL;
+    }
+    *pageEntry(heap, slab) = index + 1;
+
+    // Threads every object onto the free list, lowest address first 
+    size_t objSize = slabSizes[index];
+    unsigned int capacity = slabCapacity(index);
+    unsigned char *first = (unsigned char *)slab + sizeof(slab_header);
+    for (unsigned int i = 0; i < capacity; i++) {
+        *(void **)(first + i * objSize) = (i + 1 < capacity) ? first + (i + 1) * objSize : NULL;
+    }
+    slab->freeObjects = first;
+    slab->sizeClass = index;
+    slab->numFree = capacity;
+    pushPartial(heap, slab);
+    return slab;
+}
+
+// This function hands out an object from a slab of the class that fits requested_size 
+static void *slabAlloc(heap_t *heap, size_t requested_size) {
+    size_t index = slabClassOf[requested_size >> 3];
+    slab_header *slab = heap->partialSlabs[index];
+    if (slab == NULL) {
+        slab = newSlab(heap, index);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+
+    void *ptr = slab->freeObjects;
+    slab->freeObjects = *(void **)ptr;
+    slab->numFree--;
+
+    // A full slab has nothing more to give, so it leaves the list 
+    if (slab->numFree == 0) {
+        removePartial(heap, slab);
+    }
+    return ptr;
+}
+
+// This function returns an object to its slab, and the slab to the heap once it is empty 
+static void slabFree(heap_t *heap, void *ptr) {
+    slab_header *slab = slabOf(ptr);
+    *(void **)ptr = slab->freeObjects;
+    slab->freeObjects = ptr;
+    slab->numFree++;
+
+    if (slab->numFree == 1) {
+        pushPartial(heap, slab); // was full, has room again 
+    } else if (slab->numFree == slabCapacity(slab->sizeClass) &&
+               (slab->prev != NULL || slab->next != NULL)) {
+        // An empty slab stays only while it is alone on its class's partial list, so alloc/free pairs don't churn slabs. Full slabs of the class don't count 
+        removePartial(heap, slab);
+        *pageEntry(heap, slab) = 0;
+        freeBlock(heap, slab);
+    }
+}
+
+// This function sets up a heap's state for the region of heap_size bytes at heap_start 
+static bool initHeap(heap_t *heap, void *heap_start, size_t heap_size) {
     // Sets up the initial state with one large free block covering the entire heap 
     if (heap_start == NULL) {
         return false;
     }
     
-    // Initializes the global state variables 
-    heapStart = heap_start;
-    heapSize = heap_size;
-    freeSpace = heapSize; 
-    freeEnd = heapStart;
-    sizeUsed = 0; 
+    // Reserves the page map at the top of the segment, one byte per page of heap 
+    size_t mapSize = roundup((heap_size >> SLAB_SHIFT) + 2);
+    if (heap_size < mapSize + MIN_BLOCK) {
+        return false;
+    }
+
+    // Forgets the high-water mark only for a new segment, since a reused one may be dirty below it 
+    if (heap_start != heap->heapStart || heap->zeroMark == NULL) {
+        heap->zeroMark = (unsigned char *)heap_start + MIN_BLOCK;
+    }
+
+    // Initializes the heap's state variables 
+    heap->heapStart = heap_start;
+    heap->heapSize = roundup(heap_size - mapSize - 7);
+    heap->freeSpace = heap->heapSize; 
+    heap->sizeUsed = 0; 
+    memset(&heap->counters, 0, sizeof(heap->counters));
+    for (size_t i = 0; i < NUM_LISTS; i++) {
+        heap->freeLists[i] = NULL;
+    }
+    memset(heap->listSizeCounts, 0, sizeof(heap->listSizeCounts));
+    memset(heap->listSizeBits, 0, sizeof(heap->listSizeBits));
+    heap->largeTree = NULL;
+
+    heap->pageMap = (unsigned char *)heap->heapStart + heap->heapSize;
+    memset(heap->pageMap, 0, mapSize);
+    for (size_t i = 0; i < NUM_SLAB_CLASSES; i++) {
+        heap->partialSlabs[i] = NULL;
+    }
 
     // Creates the initial free block header covering the entire heap 
-    curr_header mystruct;
-    mystruct.h = heap_size - 16; // available payload minus the header 
-    mystruct.prev = NULL; // first block (has no previous)
-    mystruct.next = NULL; // only block (no next)
-    *(curr_header *)heapStart = mystruct; 
+    ((curr_header *)heap->heapStart)->h = heap->heapSize - HEADER_SIZE; // available payload minus the header 
+    insertFree(heap, (size_t *)heap->heapStart);
+
+#ifdef THREAD_SAFE
+    // Objects still cached from before the reset belong to the old heap, so the caches must drop them 
+    pthread_mutex_init(&heap->lock, NULL);
+    heap->generation = __atomic_add_fetch(&lastGeneration, 1, __ATOMIC_RELAXED);
+    heap->remoteFrees = NULL;
+#endif
 
     return true; // returns true if the initialization is successfull and false otherwise 
 }
 
-// This function allocates a suitable block of memory from the heap 
-void *mymalloc(size_t requested_size) {
+// This function sets up a heap whose state sits at the front of its own segment 
+heap_t *heap_create(void *segment_start, size_t segment_size) {
+    size_t stateSize = roundup(sizeof(heap_t));
+    if (segment_start == NULL || segment_size < stateSize) {
+        return NULL;
+    }
+    heap_t *heap = segment_start;
+    if (!initHeap(heap, (unsigned char *)segment_start + stateSize, segment_size - stateSize)) {
+        return NULL;
+    }
+    return heap;
+}
+
+// This function finds room for a request in the slabs or the general heap 
+static void *allocateRequest(heap_t *heap, size_t requested_size) {
     if (requested_size == 0) {
         return NULL; // returns NULL each time the allocation fails 
     }
@@ -142,138 +723,245 @@ void *mymalloc(size_t requested_size) {
     // Rounds up to maintain an 8-byte alignment 
     requested_size = roundup(requested_size); 
 
+    // Small requests are served from the slabs 
+    if (requested_size <= SLAB_MAX_OBJECT) {
+        return slabAlloc(heap, requested_size);
+    }
+
     // Checks if the request is valid and the requested size fits into the remaining heap space 
-    if (requested_size > MAX_REQUEST_SIZE || (requested_size + sizeUsed) > heapSize) {
+    if (requested_size > MAX_REQUEST_SIZE || (requested_size + heap->sizeUsed) > heap->heapSize) {
         return NULL;
     }
 
-    size_t payload;
-    size_t state;
-    size_t space = freeSpace;
-    size_t *currentFree = (size_t *)freeEnd; 
+    // Looks up a suitable block starting at the request's size class 
+    size_t *currentFree = findFree(heap, requested_size);
+    if (currentFree == NULL) {
+        return NULL; // no suitable block found 
+    }
+    return allocateBlock(heap, currentFree, requested_size);
+}
 
-    // Traverses the free list to find a suitable block 
-    while (space > 0) {
-        if (currentFree == NULL) {
-            break;
-        } 
+// This function allocates a suitable block of memory from the heap 
+static void *mallocUnlocked(heap_t *heap, size_t requested_size) {
+    void *ptr = allocateRequest(heap, requested_size);
+    if (ptr != NULL) {
+        heap->counters.mallocs++;
+    }
+    return ptr;
+}
 
-        curr_header mystruct = *(curr_header *)currentFree;
-        size_t h = mystruct.h;
-        payload = h;
-        state = h & 1; // extracts the status bit 
-
-        if (state == 0) { // the block is free 
-            // Check if the block is large enough for the requested size
-            if (requested_size <= MAX_REQUEST_SIZE && requested_size <= payload) {
-                size_t used = 16 + payload;
-                
-                //Split the block is there is enough free space left over 
-                if ((payload - requested_size) > 24) {
-                    splitFunc(currentFree, &used, &payload, requested_size);
-                } else { 
-                    // Use the entire block without splitting 
-                    cantSplit(&used, currentFree, payload);
-                }
-                
-                // Updates global counter variables 
-                sizeUsed += used;
-                freeSpace -= used; 
-
-                // Marks the block as allocated by setting the status bit 
-                if ((payload & 1) == 0) {
-                    mystruct.h = payload ^ 1; // sets the LSB to 1 
-                } else {
-                    printf("invalid payload");
-                }
-                *(curr_header *)currentFree = mystruct; 
+// This function allocates a block whose payload address is a multiple of alignment (a power of two) 
+static void *alignedAllocUnlocked(heap_t *heap, size_t alignment, size_t requested_size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    // Every block is 8-byte aligned already 
+    if (alignment <= ALIGNMENT) {
+        return mallocUnlocked(heap, requested_size);
+    }
+    if (requested_size == 0) {
+        return NULL;
+    }
+
+    requested_size = roundup(requested_size);
+    if (requested_size < MIN_PAYLOAD) {
+        requested_size = MIN_PAYLOAD;
+    }
+    if (requested_size > MAX_REQUEST_SIZE || (requested_size + heap->sizeUsed) > heap->heapSize) {
+        return NULL;
+    }
+
+    // Slab objects are only 8-byte aligned, so even small requests get a general block 
+    void *ptr = allocateAligned(heap, requested_size, alignment, 0);
+    if (ptr != NULL) {
+        heap->counters.mallocs++;
+    }
+    return ptr;
+}
+
+// This function allocates a zeroed array of nmemb elements of the given size 
+static void *callocUnlocked(heap_t *heap, size_t nmemb, size_t size) {
+    // Rejects requests whose total size overflows 
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    size_t total = nmemb * size;
+
+    // The mark is read before the allocation raises it past the new block 
+    unsigned char *mark = heap->zeroMark;
+    unsigned char *ptr = mallocUnlocked(heap, total);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    // Small objects come from slabs whose free lists run through them, so they are always cleared 
+    if (total <= SLAB_MAX_OBJECT) {
+        memset(ptr, 0, total);
+        return ptr;
+    }
 
-                // Returns a pointer to the payload 
-                unsigned char *payload_address = (unsigned char *)currentFree + 16;
-                void *ptr = payload_address; 
+    // Only the part below the old high-water mark can hold old data, the rest is still zero from mmap 
+    if (ptr < mark) {
+        size_t dirty = mark - ptr;
+        memset(ptr, 0, dirty < total ? dirty : total);
+    }
+
+    // A block that reaches the end of the heap also takes in the last free block's footer 
+    unsigned char *heapEnd = (unsigned char *)heap->heapStart + heap->heapSize;
+    if (ptr + total > heapEnd - sizeof(size_t)) {
+        memset(heapEnd - sizeof(size_t), 0, ptr + total - (heapEnd - sizeof(size_t)));
+    }
+    return ptr;
+}
 
-                return ptr;
+// This function allocates n blocks of the same size, carving them all out of one free block when it can 
+static size_t mallocBatchUnlocked(heap_t *heap, size_t size, size_t n, void *out[]) {
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+    size_t requested_size = roundup(size);
+    size_t done = 0;
+
+    // Small blocks come from the slabs, where each allocation is already a list pop 
+    if (requested_size <= SLAB_MAX_OBJECT) {
+        for (; done < n; done++) {
+            out[done] = slabAlloc(heap, requested_size);
+            if (out[done] == NULL) {
+                break;
             }
-        } else { 
-            // Found allocated block in free list during malloc 
-            printf("invalid address inside free list at malloc");
-        } 
+        }
+        heap->counters.mallocs += done;
+        return done;
+    }
+    if (requested_size > MAX_REQUEST_SIZE) {
+        return 0;
+    }
+
+    // Lays the blocks out back to back as one allocation, then writes a header for each of them 
+    size_t stride = HEADER_SIZE + requested_size;
+    size_t *currentFree = NULL;
+    if (n <= (heap->heapSize - heap->sizeUsed) / stride) {
+        currentFree = findFree(heap, n * stride - HEADER_SIZE);
+    }
+    if (currentFree != NULL) {
+        unsigned char *header = (unsigned char *)currentFree;
+        allocateBlock(heap, currentFree, n * stride - HEADER_SIZE);
+        size_t h = ((curr_header *)header)->h;
 
-        space -= (16 + payload);
-        currentFree = mystruct.next;
+        // The last block keeps any slack that was too small to split off 
+        size_t last = (h & SIZE_MASK) - (n - 1) * stride;
+        for (size_t i = 0; i < n; i++) {
+            size_t payload = (i == n - 1) ? last : requested_size;
+            ((curr_header *)header)->h = payload | ALLOC_BIT | (i == 0 ? (h & PREV_FREE_BIT) : 0);
+            out[i] = header + HEADER_SIZE;
+            header += stride;
+        }
+        heap->counters.mallocs += n;
+        return n;
     }
 
-    return NULL; // no suitable block found 
+    // Falls back to one block at a time when no single free block can hold them all 
+    for (; done < n; done++) {
+        out[done] = mallocUnlocked(heap, size);
+        if (out[done] == NULL) {
+            break;
+        }
+    }
+    return done;
 }
 
-// This function frees a previously allocated block of memory and coalesces with right neighbour 
-void myfree(void *ptr) { 
-    if (ptr != NULL) { 
-        //Gets the header of the block being freed 
-        unsigned char *header = (unsigned char *)ptr - 16;
-        curr_header mystruct = *(curr_header *)header;
-        size_t payload = mystruct.h ^ 1; // clears allocated bit to get actual payload size 
+// This function orders two pointers by address for qsort 
+static int compareAddresses(const void *a, const void *b) {
+    uintptr_t first = (uintptr_t)*(void *const *)a;
+    uintptr_t second = (uintptr_t)*(void *const *)b;
+    return (first > second) - (first < second);
+}
 
-        // Updates the global counters 
-        size_t newPayload = 0;
-        sizeUsed -= (payload + 16);
-        freeSpace += (payload + 16);
+// This function frees a batch of blocks, merging each run of neighbours in the batch before freeing it 
+static void freeBatchUnlocked(heap_t *heap, void *ptrs[], size_t n) {
+    /* - Sorting by address puts blocks that sit next to each other side by side
+       - Each run of neighbours is turned into one allocated block first, so the
+         run is coalesced and filed on the free lists only once 
+    */ 
+    qsort(ptrs, n, sizeof(void *), compareAddresses);
 
-        // Checks if the right neighbour can be coalesced 
-        unsigned char *nextAddress = (unsigned char *)ptr + payload; 
+    size_t i = 0;
+    while (i < n) {
+        unsigned char *ptr = ptrs[i++];
+        if (ptr == NULL) {
+            continue;
+        }
+        heap->counters.frees++;
+        if (isSlabObject(heap, ptr)) {
+            slabFree(heap, ptr);
+            continue;
+        }
 
-        // Prevents reading beyond the bounds of the heap 
-        if (nextAddress < (unsigned char *)heapStart + heapSize) {
-            curr_header next_header = *(curr_header *)nextAddress;
-            size_t next_payload = next_header.h;
-
-            // Coalesces with right neighbour if its free 
-            if ((next_payload & 1) == 0) { // right neighbour is free 
-                newPayload = payload + (16 + next_payload);
-                mystruct.h = newPayload; // combined payload size 
-                mystruct.prev = next_header.prev;
-                mystruct.next = next_header.next;
-                *(curr_header *)header = mystruct;
-
-                // Updates the free list pointers around the coalesced block 
-                if (next_header.prev != NULL) {
-                    curr_header prevStruct = *(curr_header *)next_header.prev;
-                    prevStruct.next = (size_t *)header;
-                    *(curr_header *)next_header.prev = prevStruct;
-                }
-            
-                if (next_header.next != NULL) {
-                    curr_header nextStruct = *(curr_header *)next_header.next;
-                    nextStruct.prev = (size_t *)header;
-                    *(curr_header *)next_header.next = nextStruct; 
-                }
+        // Absorbs every following block of the batch that starts right where the run ends 
+        unsigned char *header = ptr - HEADER_SIZE;
+        size_t h = ((curr_header *)header)->h;
+        size_t payload = h & SIZE_MASK;
+        while (i < n && (unsigned char *)ptrs[i] == ptr + payload + HEADER_SIZE && !isSlabObject(heap, ptrs[i])) {
+            payload += HEADER_SIZE + (((curr_header *)((unsigned char *)ptrs[i] - HEADER_SIZE))->h & SIZE_MASK);
+            i++;
+            heap->counters.frees++;
+            heap->counters.coalesces++;
+        }
+        ((curr_header *)header)->h = payload | (h & ~SIZE_MASK);
+        freeBlock(heap, ptr);
+    }
+}
 
-                // Changes freeList to reflect that mystruct is the first item in the list if necessary 
-                if (next_header.prev == NULL) {
-                    freeEnd = header;
-                }
-                return;
-            }
-        } else { // No coalescing possible 
-            mystruct.h = payload; // Mark as free 
-            mystruct.prev = NULL;
-            mystruct.next = (size_t *)freeEnd; 
-
-            if (freeEnd != NULL) {
-            curr_header freeList = *(curr_header *)freeEnd;
-            freeList.prev = (size_t *)header;
-            *(curr_header *)freeEnd = freeList;
-            } 
+// This function frees a previously allocated block, sending slab objects back to their slab 
+static void freeUnlocked(heap_t *heap, void *ptr) { 
+    if (ptr != NULL) { 
+        heap->counters.frees++;
+        if (isSlabObject(heap, ptr)) {
+            slabFree(heap, ptr);
+        } else {
+            freeBlock(heap, ptr);
+        }
+    }
+}
 
-            *(curr_header *)header = mystruct;
-            freeEnd = header; // this block becomes new freeList head
+// This function frees a block whose size the caller already knows 
+static void freeSizedUnlocked(heap_t *heap, void *ptr, size_t size) {
+    /* - The page map alone routes the free, so a slab object is freed without
+         reading anything but its slab's header 
+       - Debug builds check that the size fits the block it is freeing 
+    */ 
+    if (ptr != NULL) {
+        bool slab = isSlabObject(heap, ptr);
+#ifndef NDEBUG
+        size_t capacity = slab ? slabSizes[*pageEntry(heap, ptr) - 1] : (((curr_header *)((unsigned char *)ptr - HEADER_SIZE))->h & SIZE_MASK);
+        assert(size <= capacity); // size doesn't match the block 
+#endif
+        heap->counters.frees++;
+        if (slab) {
+            slabFree(heap, ptr);
+        } else {
+            freeBlock(heap, ptr);
         }
     }
 }
 
+// This function returns the payload size of a block, which can be more than was asked for 
+static size_t usableSizeUnlocked(heap_t *heap, void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    // Slab objects have no header, their class gives their size 
+    if (isSlabObject(heap, ptr)) {
+        return slabSizes[*pageEntry(heap, ptr) - 1];
+    }
+    return ((curr_header *)((unsigned char *)ptr - HEADER_SIZE))->h & SIZE_MASK;
+}
+
 // This function reallocates a memory block to a new size 
-void *myrealloc(void *old_ptr, size_t new_size) { 
-    /* - Attempts in-place reallocation 
+static void *reallocUnlocked(heap_t *heap, void *old_ptr, size_t new_size) { 
+    /* - Attempts in-place reallocation, growing into a free right neighbour if possible 
        - If it's not possible, falls back to the simple approach by:  
             - Finding new block (malloc)
             - Copying the data 
@@ -282,91 +970,147 @@ void *myrealloc(void *old_ptr, size_t new_size) {
 
     // Handles the edge cases 
     if (new_size == 0 && old_ptr != NULL) {
-         myfree(old_ptr);
+         freeUnlocked(heap, old_ptr);
          return old_ptr;
     }
     
     size_t requested_size = roundup(new_size);
-    if (requested_size > MAX_REQUEST_SIZE || (requested_size + sizeUsed) > heapSize) {
+    if (requested_size < MIN_PAYLOAD) {
+        requested_size = MIN_PAYLOAD;
+    }
+    if (requested_size > MAX_REQUEST_SIZE || (requested_size + heap->sizeUsed) > heap->heapSize) {
         return NULL;
     }
     
     if (old_ptr == NULL) {
-        return mymalloc(new_size);
+        return mallocUnlocked(heap, new_size);
+    }
+
+    // Slab objects stay put while the new size fits their class, and move otherwise 
+    if (isSlabObject(heap, old_ptr)) {
+        size_t objSize = slabSizes[*pageEntry(heap, old_ptr) - 1];
+        if (new_size <= objSize) {
+            heap->counters.reallocs++;
+            heap->counters.reallocs_in_place++;
+            return old_ptr;
+        }
+        void *ptr = allocateRequest(heap, new_size);
+        if (ptr == NULL) {
+            return NULL;
+        }
+        memcpy(ptr, old_ptr, objSize);
+        slabFree(heap, old_ptr);
+        heap->counters.reallocs++;
+        heap->counters.reallocs_moved++;
+        return ptr;
     }
     
     // Try in-place realloc if the current payload is large enough
-    unsigned char *old_pointer = (unsigned char *)old_ptr - 16;
+    unsigned char *old_pointer = (unsigned char *)old_ptr - HEADER_SIZE;
     curr_header old_header = *(curr_header *)old_pointer;
-    size_t old_payload = old_header.h ^ 1; // Get the actual payload size 
+    size_t old_payload = old_header.h & SIZE_MASK; // Get the actual payload size 
     
     if (requested_size <= old_payload) {
-        return old_ptr; // Current block is sufficient 
+        // Current block is sufficient, so the surplus goes back to the free lists 
+        releaseTail(heap, old_pointer, requested_size);
+        heap->counters.reallocs++;
+        heap->counters.reallocs_in_place++;
+        return old_ptr;
     }
-    
-    // Allocates new payload because in-place realloc not possible 
-    size_t payload;
-    size_t space = freeSpace;
-    size_t *currentFree = (size_t *)freeEnd;
-   
-    // Traverses heap to find a suitable block (malloc)
-    while (space > 0) {
-        if (currentFree == NULL) {
-            break;
-        }
 
-        curr_header mystruct = *(curr_header *)currentFree;
-        size_t h = mystruct.h;
-        payload = h;
-        size_t state = h & 1;
+    // Try growing in place by absorbing the right neighbour if it is free and big enough 
+    unsigned char *nextAddress = (unsigned char *)old_ptr + old_payload;
+    unsigned char *heapEnd = (unsigned char *)heap->heapStart + heap->heapSize;
+    if (nextAddress < heapEnd && (((curr_header *)nextAddress)->h & ALLOC_BIT) == 0) {
+        size_t next_payload = ((curr_header *)nextAddress)->h;
+        size_t combined = old_payload + HEADER_SIZE + next_payload;
 
-        if (state == 0) { 
-            // Checks if the requested size is smaller than the payload
-            if (requested_size <= MAX_REQUEST_SIZE && requested_size <= payload) {
-                size_t used = 16 + payload;
+        if (requested_size <= combined) {
+            removeFree(heap, (size_t *)nextAddress);
+            ((curr_header *)old_pointer)->h = combined | (old_header.h & ~SIZE_MASK);
+            heap->sizeUsed += (HEADER_SIZE + next_payload);
+            heap->freeSpace -= (HEADER_SIZE + next_payload);
 
-                // Check if the payload can be split or whether to use entire block 
-                if ((payload - requested_size) > 24) {
-                    splitFunc(currentFree, &used, &payload, requested_size);
-                } else {
-                    cantSplit(&used, currentFree, payload);
-                }
-                
-                // Updates the counters and marks block as allocated 
-                sizeUsed += used;
-                freeSpace -= used;
-                if ((payload & 1) == 0) {
-                    mystruct.h = payload ^ 1; // Sets allocated bit 
-                } else {
-                    printf("invalid payload");
-                }
-                *(curr_header *)currentFree = mystruct; 
+            // The block after the absorbed neighbour now follows an allocated block 
+            unsigned char *afterNext = nextAddress + HEADER_SIZE + next_payload;
+            if (afterNext < heapEnd) {
+                ((curr_header *)afterNext)->h &= ~PREV_FREE_BIT;
+            }
+
+            // Splits off whatever the request did not need 
+            releaseTail(heap, old_pointer, requested_size);
+            raiseMark(heap, old_pointer);
+            heap->counters.reallocs++;
+            heap->counters.reallocs_in_place++;
+            heap->counters.coalesces++;
+            return old_ptr;
+        }
+    }
+    
+    // Allocates new payload because in-place realloc not possible 
+    size_t *currentFree = findFree(heap, requested_size);
+    if (currentFree == NULL) {
+        return NULL; // no suitable block found 
+    }
+    void *ptr = allocateBlock(heap, currentFree, requested_size);
 
-                // Copies old data to new location and frees the old block 
-                unsigned char *payload_address = (unsigned char *)currentFree + 16;
-                void *ptr = payload_address;
-                memmove(ptr, old_ptr, old_payload); // uses memmove for safe copying 
-                myfree(old_ptr); 
+    // Copies old data to new location and frees the old block 
+    memmove(ptr, old_ptr, old_payload); // uses memmove for safe copying 
+    freeBlock(heap, old_ptr); 
+    heap->counters.reallocs++;
+    heap->counters.reallocs_moved++;
 
-                return ptr;
-            }
-        } else { 
-            // Allocated block in free list 
-            printf("invalid address inside free list at realloc");
-        } 
+    return ptr;
+}
+
+// This function reports the running counters along with the current state of the free lists and tree 
+static void statsUnlocked(heap_t *heap, struct heap_stats *stats) {
+    *stats = heap->counters;
+    stats->bytes_in_use = heap->sizeUsed;
+    stats->bytes_free = heap->freeSpace;
 
-        space -= (16 + payload);
-        currentFree = mystruct.next;
+    // The largest free block is the rightmost node of the tree, or else the highest listed size 
+    stats->largest_free = 0;
+    if (heap->largeTree != NULL) {
+        tree_node *node = heap->largeTree;
+        while (node->right != NULL) {
+            node = node->right;
+        }
+        stats->largest_free = node->h;
+        return;
     }
+    for (size_t word = NUM_LIST_SIZES / 64; word-- > 0; ) {
+        if (heap->listSizeBits[word] != 0) {
+            stats->largest_free = (word * 64 + 63 - __builtin_clzll(heap->listSizeBits[word])) << 3;
+            break;
+        }
+    }
+}
 
-    return NULL; // no suitable block found 
+// This function checks a subtree is ordered between lo and hi and AVL balanced, adding its blocks to *freed 
+static bool checkTree(tree_node *node, tree_node *lo, tree_node *hi, size_t *height, size_t *freed) {
+    if (node == NULL) {
+        *height = 0;
+        return true;
+    }
+    if ((node->h & ~SIZE_MASK) != 0 || node->h < LARGE_BLOCK ||
+        (lo != NULL && !nodeLess(lo, node)) || (hi != NULL && !nodeLess(node, hi))) {
+        return false;
+    }
 
+    size_t left, right;
+    if (!checkTree(node->left, lo, node, &left, freed) || !checkTree(node->right, node, hi, &right, freed)) {
+        return false;
+    }
+    *height = (left > right ? left : right) + 1;
+    *freed += (node->h + HEADER_SIZE);
+    return node->height == *height && left <= right + 1 && right <= left + 1;
 }
 
 // Validates the heap's consistency by checking the internal data structures 
-bool validate_heap() {
+static bool validateUnlocked(heap_t *heap) {
     // Sanity check 
-    if (sizeUsed > heapSize) {
+    if (heap->sizeUsed > heap->heapSize) {
         return false;
     } 
 
@@ -376,50 +1120,117 @@ bool validate_heap() {
     size_t used = 0;
     size_t state;
     size_t frees = 0; 
+    size_t freeCount = 0; // number of free blocks, to check the counter heap_stats reports 
+    size_t prevFree = 0; 
 
     // Used to check size used and size free
-    for (size_t i = 0; i < heapSize; i += 16) {
-        unsigned char *nextIndex = (unsigned char *)heapStart + i;
+    for (size_t i = 0; i < heap->heapSize; i += HEADER_SIZE) {
+        unsigned char *nextIndex = (unsigned char *)heap->heapStart + i;
         mystruct = *(curr_header *)nextIndex;
-        state = mystruct.h & 1;
-        payload = mystruct.h; 
+        state = mystruct.h & ALLOC_BIT;
+        payload = mystruct.h & SIZE_MASK; 
+
+        // The left-neighbour bit must match what we actually saw to the left 
+        if (((mystruct.h & PREV_FREE_BIT) != 0) != prevFree) {
+            breakpoint();
+            return false;
+        }
 
         if (state == 1) { // allocated block 
-            payload = mystruct.h ^ 1; // get actual payload size 
-            used += (16 + payload);
+            used += (HEADER_SIZE + payload);
         } else if (state == 0) { // free block 
-            frees += (16 + payload);
+            // Adjacent free blocks should have been coalesced, and the footer must match the header 
+            if (prevFree || *(size_t *)(nextIndex + HEADER_SIZE + payload - sizeof(size_t)) != payload) {
+                breakpoint();
+                return false;
+            }
+            frees += (HEADER_SIZE + payload);
+            freeCount++;
         } 
 
+        prevFree = (state == 0);
         i += payload; // move to the next block 
     }
     
-    // Used to calculate size free and check whether the freeList is accurate
-    size_t *current = (size_t *)freeEnd;
+    // Used to calculate size free and check whether the free lists are accurate
     size_t freed = 0;
-    size_t freePayload; 
+    size_t sizeCounts[NUM_LIST_SIZES] = {0};
+    for (size_t index = 0; index < NUM_LISTS; index++) {
+        size_t *prev = NULL;
+        for (size_t *current = heap->freeLists[index]; current != NULL; current = ((curr_header *)current)->next) {
+            curr_header *freeStructs = (curr_header *)current;
+            size_t freePayload = freeStructs->h; 
 
-    while (current != NULL) {
-        curr_header freeStructs = *(curr_header *)current;
-        freePayload = freeStructs.h; 
+            // Free block shouldn't have allocated bit set, and must be filed under its own size class 
+            if ((freePayload & ~SIZE_MASK) != 0 || freePayload >= LARGE_BLOCK || sizeClass(freePayload) != index) {
+                breakpoint();
+                return false;
+            } 
+
+            // Back links must mirror the forward links 
+            if (freeStructs->prev != prev) {
+                breakpoint();
+                return false;
+            }
+
+            freed += (freePayload + HEADER_SIZE);
+            sizeCounts[freePayload >> 3]++;
+            prev = current;
+        }
+    } 
 
-        // Free block shouldn't have allocated bit set 
-        if ((freePayload & 1) == 1) {
+    // The per-size counts and their bits must match what the lists hold 
+    for (size_t slot = 0; slot < NUM_LIST_SIZES; slot++) {
+        bool bit = (heap->listSizeBits[slot >> 6] >> (slot & 63)) & 1;
+        if (sizeCounts[slot] != heap->listSizeCounts[slot] || bit != (sizeCounts[slot] != 0)) {
             breakpoint();
             return false;
-        } 
+        }
+    }
 
-        freed += (freePayload + 16);
-        current = freeStructs.next;
-    } 
+    size_t treeHeight;
+    if (!checkTree(heap->largeTree, NULL, NULL, &treeHeight, &freed)) {
+        breakpoint();
+        return false;
+    }
+
+    // Every free block in the heap must be reachable from a free list or the tree 
+    if (freed != frees || freeCount != heap->counters.free_blocks) {
+        breakpoint();
+        return false;
+    }
+
+    // Every slab with room must be a marked slab page whose free objects add up 
+    for (size_t index = 0; index < NUM_SLAB_CLASSES; index++) {
+        for (slab_header *slab = heap->partialSlabs[index]; slab != NULL; slab = slab->next) {
+            if (*pageEntry(heap, slab) != index + 1 || slab->sizeClass != index || slab->numFree == 0 ||
+                slab->numFree > slabCapacity(index)) {
+                breakpoint();
+                return false;
+            }
+
+            unsigned int count = 0;
+            for (unsigned char *obj = slab->freeObjects; obj != NULL; obj = *(void **)obj) {
+                size_t offset = obj - ((unsigned char *)slab + sizeof(slab_header));
+                if (slabOf(obj) != slab || offset % slabSizes[index] != 0 || ++count > slab->numFree) {
+                    breakpoint();
+                    return false;
+                }
+            }
+            if (count != slab->numFree) {
+                breakpoint();
+                return false;
+            }
+        }
+    }
 
     // Verify consistency of accounting 
-    if ((frees + used) != heapSize) {
+    if ((frees + used) != heap->heapSize) {
         breakpoint();
         return false;
     } 
 
-    if ((freeSpace + sizeUsed) != heapSize) {
+    if ((heap->freeSpace + heap->sizeUsed) != heap->heapSize) {
         breakpoint();
         return false;
     } 
@@ -428,14 +1239,930 @@ bool validate_heap() {
 }
 
 // This file dumps the contents of the heap by printing out the diagnostic info of current heap 
-void dump_heap() {
-    printf("Heap starts at address %p and ends at %p. %lu bytes currently used.\n", heapStart, (char *)heapStart + heapSize, sizeUsed);
+static void dumpHeap(heap_t *heap) {
+    printf("Heap starts at address %p and ends at %p. %lu bytes currently used.\n", heap->heapStart, (char *)heap->heapStart + heap->heapSize, heap->sizeUsed);
     
     size_t index = 0; 
-    while (index < heapSize) {
-        char *curr = (char *)heapStart + index;
+    while (index < heap->heapSize) {
+        char *curr = (char *)heap->heapStart + index;
         size_t *cur = (size_t *)curr;
         printf("The payload is: %zu", *cur);
         index = (*cur + 16);
     }
-}
\ No newline at end of file
+}
+
+/* 
+  THREAD CACHE 
+  With -DTHREAD_SAFE, every heap_ function takes the heap's lock, except for
+  slab-sized heap_malloc and heap_free calls that the calling thread's cache
+  can serve. The cache keeps up to TCACHE_COUNT freed objects per slab class,
+  for one heap at a time, in singly-linked lists threaded through the objects.
+  Those objects still count as allocated in the heap. On a miss the thread
+  takes the lock once to pull TCACHE_FILL objects from the slabs, and when a
+  list overflows it gives half of it back the same way. Calls served from
+  the cache are counted in the cache, and the counts are added to the heap's
+  the next time the thread holds its lock. A thread's cache goes back to the
+  heap when the thread exits or starts using a different heap. 
+
+  A thread whose cache belongs to another heap doesn't take the lock to free
+  a block: it pushes the block onto the heap's remote-free stack with one
+  compare-and-swap. The next heap_malloc on that heap takes the whole stack
+  with one exchange and frees its blocks under a single lock. 
+ */ 
+
+#ifdef THREAD_SAFE
+
+#define TCACHE_COUNT 16
+#define TCACHE_FILL (TCACHE_COUNT / 2)
+
+// Per-thread cache of freed slab objects 
+typedef struct {
+    heap_t *heap; // heap the cached objects belong to, NULL when empty 
+    size_t generation; // heap's generation when the cache was filled 
+    void *bins[NUM_SLAB_CLASSES]; // cached objects of each slab class 
+    unsigned int counts[NUM_SLAB_CLASSES]; // number of objects in each bin 
+    size_t mallocs; // allocations served here and not yet added to the heap's counters 
+    size_t frees; // frees served here and not yet added to the heap's counters 
+} thread_cache;
+
+static __thread thread_cache tcache;
+static __thread size_t lockWaits; // times this thread found a heap's lock taken 
+static pthread_key_t cacheKey; // only used to run releaseCache when a thread exits 
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+// This function takes a heap's lock and adds the calling thread's cached counts to it 
+static void lockHeap(heap_t *heap) {
+    if (pthread_mutex_trylock(&heap->lock) != 0) {
+        lockWaits++;
+        pthread_mutex_lock(&heap->lock);
+    }
+    if (tcache.heap == heap) {
+        heap->counters.mallocs += tcache.mallocs;
+        heap->counters.frees += tcache.frees;
+        tcache.mallocs = 0;
+        tcache.frees = 0;
+    }
+}
+
+// This function releases a heap's lock 
+static void unlockHeap(heap_t *heap) {
+    pthread_mutex_unlock(&heap->lock);
+}
+
+// This function returns up to count objects from the front of a bin to their slabs, the heap's lock held 
+static void drainBin(heap_t *heap, size_t index, unsigned int count) {
+    for (; count > 0 && tcache.bins[index] != NULL; count--) {
+        void *ptr = tcache.bins[index];
+        tcache.bins[index] = *(void **)ptr;
+        tcache.counts[index]--;
+        slabFree(heap, ptr);
+    }
+}
+
+// This function checks whether the calling thread allocates from some other heap (or none), so its frees here are remote 
+static bool isForeign(heap_t *heap) {
+    return tcache.heap != heap || tcache.generation != heap->generation;
+}
+
+// This function pushes a block onto a heap's remote-free stack without taking its lock 
+static void pushRemote(heap_t *heap, void *ptr) {
+    void *head = __atomic_load_n(&heap->remoteFrees, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&heap->remoteFrees, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// This function frees every block other threads have pushed onto a heap's remote-free stack 
+static void drainRemote(heap_t *heap) {
+    // A plain load first, so an empty stack costs no write to its cache line 
+    if (__atomic_load_n(&heap->remoteFrees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    // Taking the whole stack at once leaves nothing for another drainer to race on 
+    void *ptr = __atomic_exchange_n(&heap->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+    if (ptr == NULL) {
+        return;
+    }
+    lockHeap(heap);
+    while (ptr != NULL) {
+        void *next = *(void **)ptr;
+        freeUnlocked(heap, ptr);
+        ptr = next;
+    }
+    unlockHeap(heap);
+}
+
+// This function gives the whole cache back to its heap, unless the heap was reset since it was filled 
+static void releaseCache(void *unused) {
+    heap_t *heap = tcache.heap;
+    if (heap != NULL && tcache.generation == heap->generation) {
+        lockHeap(heap);
+        for (size_t index = 0; index < NUM_SLAB_CLASSES; index++) {
+            drainBin(heap, index, tcache.counts[index]);
+        }
+        unlockHeap(heap);
+    }
+    memset(&tcache, 0, sizeof(tcache));
+}
+
+// This function creates the key whose destructor releases a thread's cache 
+static void createCacheKey(void) {
+    pthread_key_create(&cacheKey, releaseCache);
+}
+
+// This function points the calling thread's cache at a heap, giving back what it held for another one 
+static void claimCache(heap_t *heap) {
+    if (tcache.heap == heap && tcache.generation == heap->generation) {
+        return;
+    }
+    if (tcache.heap == NULL) {
+        // First use by this thread, so it needs the exit hook 
+        pthread_once(&cacheKeyOnce, createCacheKey);
+        pthread_setspecific(cacheKey, &tcache);
+    }
+    releaseCache(NULL);
+    tcache.heap = heap;
+    tcache.generation = heap->generation;
+}
+
+// Every allocating entry point drains the remote-free stack and claims the cache, so only frees from allocating threads are local 
+void *heap_malloc(heap_t *heap, size_t requested_size) {
+    drainRemote(heap);
+    claimCache(heap);
+    if (requested_size == 0 || requested_size > SLAB_MAX_OBJECT) {
+        lockHeap(heap);
+        void *ptr = mallocUnlocked(heap, requested_size);
+        unlockHeap(heap);
+        return ptr;
+    }
+
+    // Slab-sized requests are served from the cache when it has an object of their class 
+    size_t index = slabClassOf[roundup(requested_size) >> 3];
+    void *ptr = tcache.bins[index];
+    if (ptr != NULL) {
+        tcache.bins[index] = *(void **)ptr;
+        tcache.counts[index]--;
+        tcache.mallocs++;
+        return ptr;
+    }
+
+    // A miss refills the bin under the same lock that serves the request 
+    lockHeap(heap);
+    ptr = mallocUnlocked(heap, requested_size);
+    for (unsigned int i = 0; ptr != NULL && i < TCACHE_FILL; i++) {
+        void *obj = slabAlloc(heap, slabSizes[index]);
+        if (obj == NULL) {
+            break;
+        }
+        *(void **)obj = tcache.bins[index];
+        tcache.bins[index] = obj;
+        tcache.counts[index]++;
+    }
+    unlockHeap(heap);
+    return ptr;
+}
+
+void heap_free(heap_t *heap, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    // A thread that doesn't allocate here never takes the lock, and the block waits on the heap's remote-free stack 
+    if (isForeign(heap)) {
+        pushRemote(heap, ptr);
+        return;
+    }
+    if (!isSlabObject(heap, ptr)) {
+        lockHeap(heap);
+        freeUnlocked(heap, ptr);
+        unlockHeap(heap);
+        return;
+    }
+
+    // Slab objects go to the cache, and an overflowing bin sends half of itself back 
+    size_t index = *pageEntry(heap, ptr) - 1;
+    if (tcache.counts[index] == TCACHE_COUNT) {
+        lockHeap(heap);
+        drainBin(heap, index, TCACHE_COUNT / 2);
+        unlockHeap(heap);
+    }
+    *(void **)ptr = tcache.bins[index];
+    tcache.bins[index] = ptr;
+    tcache.counts[index]++;
+    tcache.frees++;
+}
+
+void heap_free_sized(heap_t *heap, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    bool slab = isSlabObject(heap, ptr);
+    if (!slab && !isForeign(heap)) {
+        lockHeap(heap);
+        freeSizedUnlocked(heap, ptr, size);
+        unlockHeap(heap);
+        return;
+    }
+
+    // The page map gives a slab object's size without the lock, a general block's header needs it 
+    assert(!slab || size <= slabSizes[*pageEntry(heap, ptr) - 1]); // size doesn't match the block 
+    heap_free(heap, ptr);
+}
+
+void *heap_aligned_alloc(heap_t *heap, size_t alignment, size_t requested_size) {
+    drainRemote(heap);
+    claimCache(heap);
+    lockHeap(heap);
+    void *ptr = alignedAllocUnlocked(heap, alignment, requested_size);
+    unlockHeap(heap);
+    return ptr;
+}
+
+void *heap_calloc(heap_t *heap, size_t nmemb, size_t size) {
+    drainRemote(heap);
+    claimCache(heap);
+    lockHeap(heap);
+    void *ptr = callocUnlocked(heap, nmemb, size);
+    unlockHeap(heap);
+    return ptr;
+}
+
+size_t heap_malloc_batch(heap_t *heap, size_t size, size_t n, void *out[]) {
+    drainRemote(heap);
+    claimCache(heap);
+    lockHeap(heap);
+    size_t done = mallocBatchUnlocked(heap, size, n, out);
+    unlockHeap(heap);
+    return done;
+}
+
+// Resizing another thread's block doesn't move this thread's cache over to that heap 
+void *heap_realloc(heap_t *heap, void *old_ptr, size_t new_size) {
+    drainRemote(heap);
+    lockHeap(heap);
+    void *ptr = reallocUnlocked(heap, old_ptr, new_size);
+    unlockHeap(heap);
+    return ptr;
+}
+
+void heap_free_batch(heap_t *heap, void *ptrs[], size_t n) {
+    if (isForeign(heap)) {
+        for (size_t i = 0; i < n; i++) {
+            if (ptrs[i] != NULL) {
+                pushRemote(heap, ptrs[i]);
+            }
+        }
+        return;
+    }
+    lockHeap(heap);
+    freeBatchUnlocked(heap, ptrs, n);
+    unlockHeap(heap);
+}
+
+// The header shares its word with bits that neighbours rewrite under the lock, so it is read under the lock too 
+size_t heap_usable_size(heap_t *heap, void *ptr) {
+    lockHeap(heap);
+    size_t size = usableSizeUnlocked(heap, ptr);
+    unlockHeap(heap);
+    return size;
+}
+
+void heap_stats(heap_t *heap, struct heap_stats *stats) {
+    drainRemote(heap);
+    lockHeap(heap);
+    statsUnlocked(heap, stats);
+    unlockHeap(heap);
+}
+
+bool heap_validate(heap_t *heap) {
+    drainRemote(heap);
+    lockHeap(heap);
+    bool valid = validateUnlocked(heap);
+    unlockHeap(heap);
+    return valid;
+}
+
+#else
+
+void *heap_malloc(heap_t *heap, size_t requested_size) {
+    return mallocUnlocked(heap, requested_size);
+}
+
+void heap_free(heap_t *heap, void *ptr) {
+    freeUnlocked(heap, ptr);
+}
+
+void heap_free_sized(heap_t *heap, void *ptr, size_t size) {
+    freeSizedUnlocked(heap, ptr, size);
+}
+
+void *heap_aligned_alloc(heap_t *heap, size_t alignment, size_t requested_size) {
+    return alignedAllocUnlocked(heap, alignment, requested_size);
+}
+
+void *heap_calloc(heap_t *heap, size_t nmemb, size_t size) {
+    return callocUnlocked(heap, nmemb, size);
+}
+
+size_t heap_malloc_batch(heap_t *heap, size_t size, size_t n, void *out[]) {
+    return mallocBatchUnlocked(heap, size, n, out);
+}
+
+void *heap_realloc(heap_t *heap, void *old_ptr, size_t new_size) {
+    return reallocUnlocked(heap, old_ptr, new_size);
+}
+
+void heap_free_batch(heap_t *heap, void *ptrs[], size_t n) {
+    freeBatchUnlocked(heap, ptrs, n);
+}
+
+size_t heap_usable_size(heap_t *heap, void *ptr) {
+    return usableSizeUnlocked(heap, ptr);
+}
+
+void heap_stats(heap_t *heap, struct heap_stats *stats) {
+    statsUnlocked(heap, stats);
+}
+
+bool heap_validate(heap_t *heap) {
+    return validateUnlocked(heap);
+}
+
+#endif
+
+/* 
+  DEFAULT HEAP 
+  The mymalloc family works on the heap set up by myinit. With -DTHREAD_SAFE
+  that heap is really NUM_ARENAS heaps (arenas), each an equal slice of the
+  segment with its own free lists and lock (see ARENAS below). 
+ */ 
+
+#ifndef THREAD_SAFE
+
+// Heap behind the mymalloc family 
+static heap_t defaultHeap;
+
+// This function initializes the default heap behind the mymalloc family 
+bool myinit(void *heap_start, size_t heap_size) {
+    return initHeap(&defaultHeap, heap_start, heap_size);
+}
+
+void *mymalloc(size_t requested_size) {
+    return heap_malloc(&defaultHeap, requested_size);
+}
+
+void *myaligned_alloc(size_t alignment, size_t requested_size) {
+    return heap_aligned_alloc(&defaultHeap, alignment, requested_size);
+}
+
+void *mycalloc(size_t nmemb, size_t size) {
+    return heap_calloc(&defaultHeap, nmemb, size);
+}
+
+size_t mymalloc_batch(size_t size, size_t n, void *out[]) {
+    return heap_malloc_batch(&defaultHeap, size, n, out);
+}
+
+void *myrealloc(void *old_ptr, size_t new_size) {
+    return heap_realloc(&defaultHeap, old_ptr, new_size);
+}
+
+size_t myusable_size(void *ptr) {
+    return heap_usable_size(&defaultHeap, ptr);
+}
+
+void myfree(void *ptr) {
+    heap_free(&defaultHeap, ptr);
+}
+
+void myfree_sized(void *ptr, size_t size) {
+    heap_free_sized(&defaultHeap, ptr, size);
+}
+
+void myfree_batch(void *ptrs[], size_t n) {
+    heap_free_batch(&defaultHeap, ptrs, n);
+}
+
+void mystats(struct heap_stats *stats) {
+    heap_stats(&defaultHeap, stats);
+}
+
+bool validate_heap() {
+    return heap_validate(&defaultHeap);
+}
+
+void dump_heap() {
+    dumpHeap(&defaultHeap);
+}
+
+#else
+
+/* 
+  ARENAS 
+  myinit cuts the segment into up to NUM_ARENAS arenas of arenaSize bytes
+  each, built with heap_create, so the arena that owns a block is found by
+  dividing its offset in the segment by arenaSize. A thread is handed an
+  arena round-robin the first time it allocates, and moves on to the next
+  arena after it has waited for a lock ARENA_PATIENCE times, so threads
+  spread themselves over arenas that nobody else is using. Frees, reallocs
+  and size queries always go to the block's own arena, whichever thread
+  makes them. An arena that runs out of room sends the request on to the
+  others, but a single block can be no larger than an arena. 
+ */ 
+
+#ifndef NUM_ARENAS
+#define NUM_ARENAS 8
+#endif
+
+// Segments are only split while every arena gets at least this much 
+#define MIN_ARENA_SIZE (1 << 20)
+
+// Lock waits after which a thread moves to another arena 
+#define ARENA_PATIENCE 64
+
+static unsigned char *arenaBase; // start of the segment the arenas were cut from 
+static size_t arenaSize; // bytes of segment given to each arena 
+static size_t numArenas; // number of arenas in use 
+static heap_t *arenas[NUM_ARENAS];
+static size_t nextArena; // round-robin counter for handing out arenas 
+static size_t arenaEpoch; // bumped by myinit, so threads pick their arena again 
+static __thread heap_t *threadArena; // arena this thread allocates from 
+static __thread size_t threadEpoch; // arenaEpoch when threadArena was picked 
+
+#ifdef USE_RSEQ
+static void clearCpuCaches(void);
+#endif
+
+// This function cuts the segment into arenas 
+bool myinit(void *heap_start, size_t heap_size) {
+    if (heap_start == NULL) {
+        return false;
+    }
+    size_t count = heap_size / MIN_ARENA_SIZE;
+    if (count > NUM_ARENAS) {
+        count = NUM_ARENAS;
+    }
+    if (count == 0) {
+        count = 1;
+    }
+    size_t size = (heap_size / count) & ~(size_t)(SLAB_SIZE - 1);
+
+    // Slices that moved may start on old blocks, so they are treated as dirty throughout 
+    bool moved = (heap_start == arenaBase && size != arenaSize);
+    for (size_t i = 0; i < count; i++) {
+        arenas[i] = heap_create((unsigned char *)heap_start + i * size, size);
+        if (arenas[i] == NULL) {
+            return false;
+        }
+        if (moved) {
+            arenas[i]->zeroMark = (unsigned char *)arenas[i]->heapStart + arenas[i]->heapSize;
+        }
+    }
+    arenaBase = heap_start;
+    arenaSize = size;
+    numArenas = count;
+    nextArena = 0;
+    arenaEpoch++;
+#ifdef USE_RSEQ
+    clearCpuCaches();
+#endif
+    return true;
+}
+
+// This function returns the arena a block was allocated from 
+static heap_t *arenaOf(void *ptr) {
+    return arenas[((unsigned char *)ptr - arenaBase) / arenaSize];
+}
+
+// This function returns the arena the calling thread should allocate from 
+static heap_t *currentArena(void) {
+    // A new thread, a reset heap or too much waiting all move the thread to the next arena in turn 
+    if (threadEpoch != arenaEpoch || lockWaits >= ARENA_PATIENCE) {
+        // Blocks freed into the arena being left might otherwise wait there for good 
+        if (threadEpoch == arenaEpoch) {
+            drainRemote(threadArena);
+        }
+        threadArena = arenas[__atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % numArenas];
+        threadEpoch = arenaEpoch;
+        lockWaits = 0;
+    }
+    return threadArena;
+}
+
+// This function returns the arena the calling thread allocates from, or NULL if it hasn't picked one since myinit 
+static heap_t *ownArena(void) {
+    return threadEpoch == arenaEpoch ? threadArena : NULL;
+}
+
+// This function returns the arena that follows the given one 
+static heap_t *followingArena(heap_t *arena) {
+    size_t i = ((unsigned char *)arena - arenaBase) / arenaSize + 1;
+    return arenas[i < numArenas ? i : 0];
+}
+
+#ifdef USE_RSEQ
+
+/* 
+  PER-CPU CACHES 
+  With -DPERCPU_CACHE as well (x86-64 Linux with glibc 2.35 or later, which
+  registers every thread for rseq), a cache per CPU sits in front of the
+  arenas for slab objects, so cache memory grows with the number of cores
+  rather than the number of threads. Each CPU keeps a stack of up to
+  PERCPU_COUNT objects per slab class, which may come from any arena. The
+  stacks are pushed and popped in restartable sequences: the sequence checks
+  it is still on the CPU it read, and its last instruction is the single
+  store that commits. If the thread is preempted, migrated or signalled
+  before that store, the kernel sends it to the abort handler instead, and
+  it tries again. So no lock or atomic instruction is needed. An empty stack
+  is refilled with PERCPU_FILL objects from the thread's arena under one
+  lock. A full stack sends half of its objects back to their arenas, locking
+  each arena once. Threads that aren't registered, and CPUs numbered PERCPU_MAX_CPUS
+  or more, fall back to the thread caches. 
+ */ 
+
+#define PERCPU_MAX_CPUS 256
+#define PERCPU_COUNT 32
+#define PERCPU_FILL (PERCPU_COUNT / 2)
+
+// Outcomes of a restartable sequence 
+#define RSEQ_DONE 0
+#define RSEQ_ABORTED 1 // the thread left the CPU or was interrupted, so nothing was changed 
+#define RSEQ_BLOCKED 2 // the stack was empty (pop) or full (push) 
+
+#define STRINGIFY(x) #x
+#define EXPAND_STRINGIFY(x) STRINGIFY(x)
+
+// Start of every abort handler: RSEQ_SIG inside an instruction that traps, which the kernel checks before jumping to it 
+#define RSEQ_ABORT_SIGNATURE ".byte 0x0f, 0xb9, 0x3d\n\t.long " EXPAND_STRINGIFY(RSEQ_SIG) "\n\t"
+
+// Slab objects cached for one CPU, touched only by threads running on it 
+typedef struct {
+    size_t counts[NUM_SLAB_CLASSES]; // number of objects on each stack 
+    void *slots[NUM_SLAB_CLASSES][PERCPU_COUNT]; // stacks of cached objects, bottom first 
+} __attribute__((aligned(64))) cpu_cache;
+
+static cpu_cache cpuCaches[PERCPU_MAX_CPUS];
+static unsigned int cpusUsed; // one more than the highest CPU whose cache may hold objects 
+
+// This function returns the calling thread's rseq area, or NULL if its cache can't be used 
+static struct rseq *rseqArea(void) {
+    if (__rseq_size == 0) {
+        return NULL;
+    }
+    struct rseq *rs = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+    int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+    if (cpu < 0 || cpu >= PERCPU_MAX_CPUS) {
+        return NULL; // not registered, or more CPUs than caches 
+    }
+
+    // Remembers how many caches myinit has to clear 
+    unsigned int used = __atomic_load_n(&cpusUsed, __ATOMIC_RELAXED);
+    while ((unsigned int)cpu >= used &&
+           !__atomic_compare_exchange_n(&cpusUsed, &used, cpu + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return rs;
+}
+
+// This function pops an object off a stack of the given CPU, if the thread is still running there 
+static int cpuPop(struct rseq *rs, unsigned int cpu, size_t *count, void **slots, void **item) {
+    int status;
+    void *top = NULL;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "movq (%[count]), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz 5f\n\t"
+        "movq -8(%[slots], %%rcx, 8), %[top]\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%[count])\n\t"
+        "2:\n\t"
+        "movl $0, %[status]\n\t"
+        "jmp 6f\n\t"
+        RSEQ_ABORT_SIGNATURE
+        "4:\n\t"
+        "movl $1, %[status]\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "movl $2, %[status]\n\t"
+        "6:\n\t"
+        : [status] "=&r" (status), [top] "+&r" (top), [rseq_cs] "=m" (rs->rseq_cs)
+        : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [count] "r" (count), [slots] "r" (slots)
+        : "rax", "rcx", "memory", "cc");
+    *item = top;
+    return status;
+}
+
+// This function pushes an object onto a stack of the given CPU, if the thread is still running there 
+static int cpuPush(struct rseq *rs, unsigned int cpu, size_t *count, void **slots, void *item) {
+    int status;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "movq (%[count]), %%rcx\n\t"
+        "cmpq %[capacity], %%rcx\n\t"
+        "jae 5f\n\t"
+        "movq %[item], (%[slots], %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%[count])\n\t"
+        "2:\n\t"
+        "movl $0, %[status]\n\t"
+        "jmp 6f\n\t"
+        RSEQ_ABORT_SIGNATURE
+        "4:\n\t"
+        "movl $1, %[status]\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "movl $2, %[status]\n\t"
+        "6:\n\t"
+        : [status] "=&r" (status), [rseq_cs] "=m" (rs->rseq_cs)
+        : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [count] "r" (count), [slots] "r" (slots),
+          [item] "r" (item), [capacity] "i" (PERCPU_COUNT)
+        : "rax", "rcx", "memory", "cc");
+    return status;
+}
+
+// This function pops an object of a slab class off the current CPU's stack, retrying after aborts 
+static int cpuTake(struct rseq *rs, size_t index, void **item) {
+    int status;
+    do {
+        unsigned int cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+        status = cpuPop(rs, cpu, &cpuCaches[cpu].counts[index], cpuCaches[cpu].slots[index], item);
+    } while (status == RSEQ_ABORTED);
+    return status;
+}
+
+// This function pushes an object of a slab class onto the current CPU's stack, retrying after aborts 
+static int cpuStash(struct rseq *rs, size_t index, void *item) {
+    int status;
+    do {
+        unsigned int cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+        status = cpuPush(rs, cpu, &cpuCaches[cpu].counts[index], cpuCaches[cpu].slots[index], item);
+    } while (status == RSEQ_ABORTED);
+    return status;
+}
+
+// This function empties every CPU's stacks, whose objects belong to arenas that are being reset 
+static void clearCpuCaches(void) {
+    for (unsigned int cpu = 0; cpu < cpusUsed; cpu++) {
+        memset(cpuCaches[cpu].counts, 0, sizeof(cpuCaches[cpu].counts));
+    }
+    cpusUsed = 0;
+}
+
+// This function hands out a slab object from the current CPU's cache, refilling it from the arena when empty 
+static void *cpuCacheAlloc(heap_t *arena, size_t requested_size) {
+    struct rseq *rs = rseqArea();
+    if (rs == NULL) {
+        return NULL;
+    }
+    claimCache(arena); // so the count below reaches the arena's counters 
+    size_t index = slabClassOf[roundup(requested_size) >> 3];
+    void *ptr;
+    if (cpuTake(rs, index, &ptr) == RSEQ_DONE) {
+        tcache.mallocs++;
+        return ptr;
+    }
+
+    // A miss takes one object for the request and stashes more under the same lock 
+    drainRemote(arena);
+    lockHeap(arena);
+    ptr = slabAlloc(arena, slabSizes[index]);
+    if (ptr != NULL) {
+        arena->counters.mallocs++;
+    }
+    for (unsigned int i = 0; ptr != NULL && i < PERCPU_FILL; i++) {
+        void *obj = slabAlloc(arena, slabSizes[index]);
+        if (obj == NULL) {
+            break;
+        }
+        if (cpuStash(rs, index, obj) != RSEQ_DONE) {
+            slabFree(arena, obj); // another thread on this CPU filled the stack first 
+            break;
+        }
+    }
+    unlockHeap(arena);
+    return ptr;
+}
+
+// This function puts a slab object in the current CPU's cache, returning false if the cache can't be used 
+static bool cpuCacheFree(void *ptr, size_t index) {
+    struct rseq *rs = rseqArea();
+    if (rs == NULL) {
+        return false;
+    }
+    claimCache(currentArena());
+    while (cpuStash(rs, index, ptr) != RSEQ_DONE) {
+        // A full stack sends half of its objects back, taking each arena's lock once 
+        void *spill[PERCPU_COUNT / 2];
+        unsigned int n = 0;
+        while (n < PERCPU_COUNT / 2 && cpuTake(rs, index, &spill[n]) == RSEQ_DONE) {
+            n++;
+        }
+        for (unsigned int i = 0; i < n; i++) {
+            if (spill[i] == NULL) {
+                continue;
+            }
+            heap_t *owner = arenaOf(spill[i]);
+            lockHeap(owner);
+            for (unsigned int j = i; j < n; j++) {
+                if (spill[j] != NULL && arenaOf(spill[j]) == owner) {
+                    slabFree(owner, spill[j]);
+                    spill[j] = NULL;
+                }
+            }
+            unlockHeap(owner);
+        }
+    }
+    tcache.frees++;
+    return true;
+}
+
+#endif
+
+void *mymalloc(size_t requested_size) {
+    heap_t *arena = currentArena();
+#ifdef USE_RSEQ
+    if (requested_size != 0 && requested_size <= SLAB_MAX_OBJECT) {
+        void *cached = cpuCacheAlloc(arena, requested_size);
+        if (cached != NULL) {
+            return cached;
+        }
+    }
+#endif
+    void *ptr = heap_malloc(arena, requested_size);
+
+    // A full arena passes the request on to the others 
+    for (heap_t *other = followingArena(arena); ptr == NULL && other != arena; other = followingArena(other)) {
+        ptr = heap_malloc(other, requested_size);
+    }
+    return ptr;
+}
+
+void *myaligned_alloc(size_t alignment, size_t requested_size) {
+    heap_t *arena = currentArena();
+    void *ptr = heap_aligned_alloc(arena, alignment, requested_size);
+    for (heap_t *other = followingArena(arena); ptr == NULL && other != arena; other = followingArena(other)) {
+        ptr = heap_aligned_alloc(other, alignment, requested_size);
+    }
+    return ptr;
+}
+
+void *mycalloc(size_t nmemb, size_t size) {
+    heap_t *arena = currentArena();
+    void *ptr = heap_calloc(arena, nmemb, size);
+    for (heap_t *other = followingArena(arena); ptr == NULL && other != arena; other = followingArena(other)) {
+        ptr = heap_calloc(other, nmemb, size);
+    }
+    return ptr;
+}
+
+size_t mymalloc_batch(size_t size, size_t n, void *out[]) {
+    heap_t *arena = currentArena();
+    size_t done = heap_malloc_batch(arena, size, n, out);
+    for (heap_t *other = followingArena(arena); done < n && other != arena; other = followingArena(other)) {
+        done += heap_malloc_batch(other, size, n - done, out + done);
+    }
+    return done;
+}
+
+void *myrealloc(void *old_ptr, size_t new_size) {
+    if (old_ptr == NULL) {
+        return mymalloc(new_size);
+    }
+
+    // The block is resized in its own arena, and moves to another one only if that arena is full 
+    heap_t *owner = arenaOf(old_ptr);
+    void *ptr = heap_realloc(owner, old_ptr, new_size);
+    if (ptr == NULL && new_size != 0) {
+        ptr = mymalloc(new_size);
+        if (ptr != NULL) {
+            size_t old_size = heap_usable_size(owner, old_ptr);
+            memcpy(ptr, old_ptr, old_size < new_size ? old_size : new_size);
+            heap_free(owner, old_ptr);
+        }
+    }
+    return ptr;
+}
+
+size_t myusable_size(void *ptr) {
+    return ptr != NULL ? heap_usable_size(arenaOf(ptr), ptr) : 0;
+}
+
+void myfree(void *ptr) {
+    if (ptr != NULL) {
+        heap_t *owner = arenaOf(ptr);
+#ifdef USE_RSEQ
+        if (isSlabObject(owner, ptr) && cpuCacheFree(ptr, *pageEntry(owner, ptr) - 1)) {
+            return;
+        }
+#endif
+        // Another thread's block goes on its arena's remote-free stack, so its lock is never taken 
+        if (owner != ownArena()) {
+            pushRemote(owner, ptr);
+            return;
+        }
+        heap_free(owner, ptr);
+    }
+}
+
+void myfree_sized(void *ptr, size_t size) {
+    if (ptr != NULL) {
+        heap_t *owner = arenaOf(ptr);
+#ifdef USE_RSEQ
+        // A size that doesn't fit the object goes the long way, where debug builds catch it 
+        if (isSlabObject(owner, ptr) && size <= slabSizes[*pageEntry(owner, ptr) - 1] &&
+            cpuCacheFree(ptr, *pageEntry(owner, ptr) - 1)) {
+            return;
+        }
+#endif
+        // Another thread's block is checked from the page map alone, then goes on its arena's remote-free stack 
+        if (owner != ownArena()) {
+            assert(!isSlabObject(owner, ptr) || size <= slabSizes[*pageEntry(owner, ptr) - 1]); // size doesn't match the block 
+            pushRemote(owner, ptr);
+            return;
+        }
+        heap_free_sized(owner, ptr, size);
+    }
+}
+
+void myfree_batch(void *ptrs[], size_t n) {
+    // Sorted by address, the blocks of each arena sit together and go back in one batch 
+    qsort(ptrs, n, sizeof(void *), compareAddresses);
+    size_t i = 0;
+    while (i < n && ptrs[i] == NULL) {
+        i++;
+    }
+    while (i < n) {
+        heap_t *owner = arenaOf(ptrs[i]);
+        size_t end = i + 1;
+        while (end < n && arenaOf(ptrs[end]) == owner) {
+            end++;
+        }
+        if (owner != ownArena()) {
+            for (; i < end; i++) {
+                pushRemote(owner, ptrs[i]);
+            }
+            continue;
+        }
+        heap_free_batch(owner, ptrs + i, end - i);
+        i = end;
+    }
+}
+
+void mystats(struct heap_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < numArenas; i++) {
+        struct heap_stats arena;
+        heap_stats(arenas[i], &arena);
+        stats->bytes_in_use += arena.bytes_in_use;
+        stats->bytes_free += arena.bytes_free;
+        stats->free_blocks += arena.free_blocks;
+        if (arena.largest_free > stats->largest_free) {
+            stats->largest_free = arena.largest_free;
+        }
+        stats->mallocs += arena.mallocs;
+        stats->frees += arena.frees;
+        stats->reallocs += arena.reallocs;
+        stats->reallocs_in_place += arena.reallocs_in_place;
+        stats->reallocs_moved += arena.reallocs_moved;
+        stats->splits += arena.splits;
+        stats->coalesces += arena.coalesces;
+    }
+}
+
+bool validate_heap() {
+    for (size_t i = 0; i < numArenas; i++) {
+        if (!heap_validate(arenas[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void dump_heap() {
+    for (size_t i = 0; i < numArenas; i++) {
+        dumpHeap(arenas[i]);
+    }
+}
+
+#endif
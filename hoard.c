@@ -0,0 +1,1064 @@
+/* File: hoard.c
+ * -------------
+ * A Hoard-style allocator for programs with many threads. Small objects
+ * live in superblocks: SB_SIZE-byte slots of the segment, each holding
+ * objects of a single size class. Every thread allocates from one of
+ * NUM_HEAPS per-thread heaps, handed out round-robin. Each heap owns a set
+ * of superblocks, so threads on different heaps never take the same lock
+ * to allocate. A freed object always goes back to its superblock, under the
+ * lock of whichever heap owns that superblock at the time.
+ *
+ * Freeing alone could leave a heap holding lots of nearly empty superblocks
+ * that only its own threads can use. For example, one thread allocates, another
+ * frees, and the first never asks again. Then the footprint grows with the
+ * number of heaps rather than with the live data. So each heap i counts the
+ * bytes of objects in use in its superblocks (u) and the bytes of
+ * superblocks it holds (a), and keeps up the invariant
+ *     u >= (1 - f) a  or  u >= a - K * SB_SIZE
+ * with f = EMPTY_NUM / EMPTY_DEN and K = SUPERBLOCK_SLACK. A free that
+ * breaks it moves a superblock that is at least f empty to the global heap
+ * (heap 0). Any heap that runs out of room in a size class takes its next
+ * superblock from there. A malloc only adds a superblock when all of its
+ * class's are full, so beyond a constant factor of its live data, each
+ * heap holds at most K superblocks plus one partly used superblock per
+ * class. The memory held by all heaps is therefore
+ * O(live data + NUM_HEAPS * (K + NUM_CLASSES) * SB_SIZE).
+ *
+ * Within a heap, the superblocks of each class are sorted into fullness
+ * groups. mymalloc takes objects from the fullest superblock that isn't
+ * full, and the invariant sheds the emptiest. A superblock that becomes
+ * empty in the global heap goes back to the pool of slots, so any size
+ * class can reuse it.
+ *
+ * Requests above MAX_SMALL get a run of whole slots of their own, taken
+ * first-fit from a list of free runs or from the untouched slots at the
+ * top. Freed runs merge with free neighbours. The global heap's lock guards
+ * the runs. Slot state is kept in a table of descriptors at the top of the
+ * segment, one per slot, so objects carry no header, and slots nobody has
+ * used yet are never written. A thread holds at most one per-thread heap's
+ * lock at a time, which may be another thread's when it frees into a
+ * superblock that heap owns, and takes the global one only after it, so
+ * the locks are always taken in that order.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "debug_break.h"
+
+// Slots are SB_SIZE bytes and start on a multiple of SB_SIZE
+#define SB_SHIFT 13
+#define SB_SIZE ((size_t)1 << SB_SHIFT)
+
+// Largest object served from a superblock, bigger ones get a run of slots
+#define MAX_SMALL (SB_SIZE / 2)
+#define NUM_CLASSES 24
+
+// Number of per-thread heaps, not counting the global heap
+#ifndef NUM_HEAPS
+#define NUM_HEAPS 8
+#endif
+
+// Emptiness fraction f, as EMPTY_NUM / EMPTY_DEN
+#define EMPTY_NUM 1
+#define EMPTY_DEN 4
+
+// Superblocks (K) a heap may hold beyond the emptiness fraction
+#ifndef SUPERBLOCK_SLACK
+#define SUPERBLOCK_SLACK 4
+#endif
+
+// Group g holds superblocks with g to g+1 quarters of their objects in use, FULL_GROUP the full ones
+#define NUM_GROUPS 4
+#define FULL_GROUP NUM_GROUPS
+
+// Kinds of run a slot can belong to
+#define RUN_FREE 1
+#define RUN_SMALL 2
+#define RUN_LARGE 3
+
+struct heap_state;
+
+// Descriptor of one slot, kept in the table at the top of the segment
+typedef struct superblock {
+    struct heap_state *owner;   // heap holding this superblock, NULL for other runs
+    struct superblock *next;    // next superblock in the owner's group, or next free run
+    struct superblock *prev;    // previous superblock in the owner's group, or previous free run
+    void *free_objects;         // objects freed back to this superblock
+    uint32_t length;            // slots in the run, kept on its first and last slot
+    uint32_t carved;            // objects handed out from the never-used end so far
+    uint32_t in_use;            // objects currently allocated
+    unsigned char kind;         // RUN_FREE, RUN_SMALL or RUN_LARGE, kept on the first and last slot
+    unsigned char size_class;   // index into class_sizes
+    unsigned char group;        // fullness group the superblock is filed under
+    unsigned char fresh;        // formatted in a never-written slot, so objects not yet carved are zero
+} superblock_t;
+
+typedef struct heap_state {
+    pthread_mutex_t lock;
+    superblock_t *groups[NUM_CLASSES][NUM_GROUPS + 1];
+    size_t in_use;              // u: bytes of objects allocated from this heap's superblocks
+    size_t held;                // a: bytes of superblocks this heap holds
+    size_t large;               // bytes of large runs (global heap only)
+    struct heap_stats counters; // running totals reported by mystats
+} heap_state_t;
+
+static const uint32_t class_sizes[NUM_CLASSES] = {
+    8, 16, 24, 32, 48, 64, 80, 96, 128, 160, 192, 256,
+    320, 384, 512, 640, 768, 1024, 1280, 1536, 2048, 2560, 3072, 4096
+};
+static unsigned char class_of[MAX_SMALL / 8 + 1];   // class of each request size, indexed by size / 8
+
+static char *sb_base;               // address of slot 0
+static superblock_t *descriptors;   // one per slot, right after the last slot
+static size_t nslots;               // slots in the segment
+static size_t ncarved;              // slots below this have been used, the rest are untouched
+static size_t nclean;               // slots at or above this have never been written since the segment was mapped
+static superblock_t *free_runs;     // first slot of each free run below ncarved
+
+static heap_state_t heaps[NUM_HEAPS + 1];
+#define GLOBAL_HEAP (&heaps[0])
+static size_t next_heap;            // round-robin counter for handing out heaps
+static size_t heap_epoch;           // bumped by myinit, so threads pick their heap again
+static __thread heap_state_t *thread_heap;
+static __thread size_t thread_epoch;
+
+
+/* Function: roundup
+ * -----------------
+ * This function rounds up the given number to the given multiple, which
+ * must be a power of 2, and returns the result.
+ */
+size_t roundup(size_t sz, size_t mult) {
+    return (sz + mult-1) & ~(mult-1);
+}
+
+/* Function: slot_of
+ * -----------------
+ * Returns the descriptor of the slot holding the given address.
+ */
+static superblock_t *slot_of(void *ptr) {
+    return &descriptors[((char *)ptr - sb_base) >> SB_SHIFT];
+}
+
+/* Function: slot_address
+ * ----------------------
+ * Returns the address of the slot the given descriptor describes.
+ */
+static char *slot_address(superblock_t *sb) {
+    return sb_base + ((size_t)(sb - descriptors) << SB_SHIFT);
+}
+
+/* Function: capacity
+ * ------------------
+ * Returns the number of objects a superblock of the given class holds.
+ */
+static uint32_t capacity(size_t index) {
+    return SB_SIZE / class_sizes[index];
+}
+
+/* Function: group_of
+ * ------------------
+ * Returns the fullness group a superblock belongs in given its objects in
+ * use.
+ */
+static unsigned char group_of(superblock_t *sb) {
+    uint32_t cap = capacity(sb->size_class);
+    return sb->in_use == cap ? FULL_GROUP : (unsigned char)(sb->in_use * NUM_GROUPS / cap);
+}
+
+/* Function: current_heap
+ * ----------------------
+ * Returns the heap the calling thread allocates from. A new thread, or any
+ * thread after myinit, gets the next per-thread heap in turn.
+ */
+static heap_state_t *current_heap(void) {
+    if (thread_epoch != heap_epoch) {
+        thread_heap = &heaps[1 + __atomic_fetch_add(&next_heap, 1, __ATOMIC_RELAXED) % NUM_HEAPS];
+        thread_epoch = heap_epoch;
+    }
+    return thread_heap;
+}
+
+/* Function: lock_owner
+ * --------------------
+ * Locks the heap that owns the given superblock and returns it. A
+ * superblock only changes owner while both the old and the new owner are
+ * locked, so the owner is rechecked once its lock is held.
+ */
+static heap_state_t *lock_owner(superblock_t *sb) {
+    while (true) {
+        heap_state_t *owner = __atomic_load_n(&sb->owner, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&owner->lock);
+        if (__atomic_load_n(&sb->owner, __ATOMIC_RELAXED) == owner) {
+            return owner;
+        }
+        pthread_mutex_unlock(&owner->lock);
+    }
+}
+
+
+/* Function: mark_run
+ * ------------------
+ * Records the length and kind of the run starting at the given slot on its
+ * first and last slot, which is all the neighbouring runs ever look at.
+ */
+static void mark_run(superblock_t *head, size_t length, unsigned char kind) {
+    superblock_t *tail = head + length - 1;
+    head->length = tail->length = (uint32_t)length;
+    head->kind = tail->kind = kind;
+    head->owner = NULL;
+}
+
+/* Function: push_run
+ * ------------------
+ * Marks the given run free and adds it to the list of free runs.
+ */
+static void push_run(superblock_t *head, size_t length) {
+    mark_run(head, length, RUN_FREE);
+    head->prev = NULL;
+    head->next = free_runs;
+    if (free_runs != NULL) {
+        free_runs->prev = head;
+    }
+    free_runs = head;
+}
+
+/* Function: remove_run
+ * --------------------
+ * Unlinks the given run from the list of free runs.
+ */
+static void remove_run(superblock_t *head) {
+    if (head->prev != NULL) {
+        head->prev->next = head->next;
+    } else {
+        free_runs = head->next;
+    }
+    if (head->next != NULL) {
+        head->next->prev = head->prev;
+    }
+}
+
+/* Function: take_run
+ * ------------------
+ * Takes a run of the given number of slots from the first free run that
+ * fits, splitting off the rest, or else from the untouched slots at the
+ * top. Returns NULL if neither has room. The caller holds the global lock
+ * and marks the run.
+ */
+static superblock_t *take_run(size_t length) {
+    for (superblock_t *head = free_runs; head != NULL; head = head->next) {
+        if (head->length >= length) {
+            remove_run(head);
+            if (head->length > length) {
+                push_run(head + length, head->length - length);
+                GLOBAL_HEAP->counters.splits++;
+            }
+            return head;
+        }
+    }
+    if (length > nslots - ncarved) {
+        return NULL;
+    }
+    superblock_t *head = &descriptors[ncarved];
+    ncarved += length;
+    return head;
+}
+
+/* Function: touch_run
+ * -------------------
+ * Raises the clean mark past a run that is being put to use. Returns how
+ * many bytes at the start of the run may hold old data, which is all of it
+ * unless part of the run lies at or above the old mark.
+ */
+static size_t touch_run(superblock_t *head, size_t length) {
+    size_t index = head - descriptors;
+    size_t dirty = nclean > index ? nclean - index : 0;
+    if (index + length > nclean) {
+        nclean = index + length;
+    }
+    return (dirty < length ? dirty : length) << SB_SHIFT;
+}
+
+/* Function: release_run
+ * ---------------------
+ * Gives back the run starting at the given slot, merging it with free runs
+ * on either side. A run that reaches the untouched slots at the top joins
+ * them instead of going on the list. The caller holds the global lock.
+ */
+static void release_run(superblock_t *head) {
+    size_t index = head - descriptors;
+    size_t length = head->length;
+
+    if (index + length < ncarved && descriptors[index + length].kind == RUN_FREE) {
+        remove_run(&descriptors[index + length]);
+        length += descriptors[index + length].length;
+        GLOBAL_HEAP->counters.coalesces++;
+    }
+    if (index > 0 && descriptors[index - 1].kind == RUN_FREE) {
+        size_t before = descriptors[index - 1].length;
+        index -= before;
+        length += before;
+        remove_run(&descriptors[index]);
+        GLOBAL_HEAP->counters.coalesces++;
+    }
+
+    if (index + length == ncarved) {
+        ncarved = index;
+    } else {
+        push_run(&descriptors[index], length);
+    }
+}
+
+
+/* Function: link_superblock
+ * -------------------------
+ * Files a superblock under its fullness group in the given heap.
+ */
+static void link_superblock(heap_state_t *heap, superblock_t *sb) {
+    sb->group = group_of(sb);
+    superblock_t **list = &heap->groups[sb->size_class][sb->group];
+    sb->prev = NULL;
+    sb->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = sb;
+    }
+    *list = sb;
+}
+
+/* Function: unlink_superblock
+ * ---------------------------
+ * Takes a superblock off its fullness group's list in the given heap.
+ */
+static void unlink_superblock(heap_state_t *heap, superblock_t *sb) {
+    if (sb->prev != NULL) {
+        sb->prev->next = sb->next;
+    } else {
+        heap->groups[sb->size_class][sb->group] = sb->next;
+    }
+    if (sb->next != NULL) {
+        sb->next->prev = sb->prev;
+    }
+}
+
+/* Function: adopt_superblock
+ * --------------------------
+ * Hands a superblock to the given heap and adds it to the heap's counts.
+ * The caller holds the heap's lock and, if the superblock had an owner,
+ * that owner's lock too.
+ */
+static void adopt_superblock(heap_state_t *heap, superblock_t *sb) {
+    link_superblock(heap, sb);
+    heap->held += SB_SIZE;
+    heap->in_use += (size_t)sb->in_use * class_sizes[sb->size_class];
+    __atomic_store_n(&sb->owner, heap, __ATOMIC_RELAXED);
+}
+
+/* Function: disown_superblock
+ * ---------------------------
+ * Takes a superblock away from the heap that holds it, along with its
+ * share of the heap's counts.
+ */
+static void disown_superblock(heap_state_t *heap, superblock_t *sb) {
+    unlink_superblock(heap, sb);
+    heap->held -= SB_SIZE;
+    heap->in_use -= (size_t)sb->in_use * class_sizes[sb->size_class];
+}
+
+/* Function: regroup
+ * -----------------
+ * Moves a superblock whose fullness changed to its new group.
+ */
+static void regroup(heap_state_t *heap, superblock_t *sb) {
+    if (group_of(sb) != sb->group) {
+        unlink_superblock(heap, sb);
+        link_superblock(heap, sb);
+    }
+}
+
+/* Function: fullest_superblock
+ * ----------------------------
+ * Returns the fullest superblock of the given class in the heap that still
+ * has room, or NULL if it has none. Filling the fullest first leaves the
+ * emptiest ones free to drain and move on.
+ */
+static superblock_t *fullest_superblock(heap_state_t *heap, size_t index) {
+    for (int g = NUM_GROUPS - 1; g >= 0; g--) {
+        if (heap->groups[index][g] != NULL) {
+            return heap->groups[index][g];
+        }
+    }
+    return NULL;
+}
+
+/* Function: fetch_superblock
+ * --------------------------
+ * Gives the heap a superblock of the given class with room in it, taking
+ * the fullest one the global heap has or else formatting a fresh slot. The
+ * caller holds the heap's lock. Returns NULL if the segment is full.
+ */
+static superblock_t *fetch_superblock(heap_state_t *heap, size_t index) {
+    pthread_mutex_lock(&GLOBAL_HEAP->lock);
+    superblock_t *sb = fullest_superblock(GLOBAL_HEAP, index);
+    if (sb != NULL) {
+        disown_superblock(GLOBAL_HEAP, sb);
+    } else {
+        sb = take_run(1);
+        if (sb != NULL) {
+            mark_run(sb, 1, RUN_SMALL);
+            sb->size_class = (unsigned char)index;
+            sb->free_objects = NULL;
+            sb->carved = 0;
+            sb->in_use = 0;
+            sb->fresh = touch_run(sb, 1) == 0;
+        }
+    }
+    if (sb != NULL) {
+        adopt_superblock(heap, sb);
+    }
+    pthread_mutex_unlock(&GLOBAL_HEAP->lock);
+    return sb;
+}
+
+/* Function: too_empty
+ * -------------------
+ * Checks whether the heap breaks the emptiness invariant, holding more
+ * than SUPERBLOCK_SLACK superblocks' worth of free space and being more
+ * than the emptiness fraction free.
+ */
+static bool too_empty(heap_state_t *heap) {
+    return heap->in_use * EMPTY_DEN < heap->held * (EMPTY_DEN - EMPTY_NUM) &&
+           heap->in_use + SUPERBLOCK_SLACK * SB_SIZE < heap->held;
+}
+
+/* Function: shed_superblock
+ * -------------------------
+ * Moves the emptiest superblock of a per-thread heap to the global heap,
+ * or straight back to the free slots if it is empty. The caller holds the
+ * heap's lock. Returns false if every superblock is full. With f at most
+ * 1/4 that can't happen while the invariant is broken, since no class
+ * leaves more than a quarter of a full superblock unused.
+ */
+static bool shed_superblock(heap_state_t *heap) {
+    superblock_t *sb = NULL;
+    for (int g = 0; g < FULL_GROUP && sb == NULL; g++) {
+        for (size_t i = 0; i < NUM_CLASSES && sb == NULL; i++) {
+            sb = heap->groups[i][g];
+        }
+    }
+    if (sb == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&GLOBAL_HEAP->lock);
+    disown_superblock(heap, sb);
+    if (sb->in_use == 0) {
+        release_run(sb);
+    } else {
+        adopt_superblock(GLOBAL_HEAP, sb);
+    }
+    pthread_mutex_unlock(&GLOBAL_HEAP->lock);
+    return true;
+}
+
+/* Function: small_alloc
+ * ---------------------
+ * Takes an object of the given class from the heap, whose lock the caller
+ * holds, fetching another superblock if none of the heap's have room. If
+ * dirty isn't NULL, it is set to 0 for an object that has never been
+ * written and to the class size otherwise.
+ */
+static void *small_alloc(heap_state_t *heap, size_t index, size_t *dirty) {
+    superblock_t *sb = fullest_superblock(heap, index);
+    if (sb == NULL) {
+        sb = fetch_superblock(heap, index);
+        if (sb == NULL) {
+            return NULL;
+        }
+    }
+
+    // Objects nobody has used yet are carved off in address order, so untouched pages stay untouched
+    void *ptr = sb->free_objects;
+    bool clean = false;
+    if (ptr != NULL) {
+        sb->free_objects = *(void **)ptr;
+    } else {
+        ptr = slot_address(sb) + (size_t)sb->carved * class_sizes[index];
+        sb->carved++;
+        clean = sb->fresh;
+    }
+    if (dirty != NULL) {
+        *dirty = clean ? 0 : class_sizes[index];
+    }
+    sb->in_use++;
+    heap->in_use += class_sizes[index];
+    heap->counters.mallocs++;
+    regroup(heap, sb);
+    return ptr;
+}
+
+/* Function: small_free
+ * --------------------
+ * Returns an object to its superblock under the owner's lock, then either
+ * gives an empty global superblock back to the free slots or restores the
+ * emptiness invariant of a per-thread owner.
+ */
+static void small_free(superblock_t *sb, void *ptr) {
+    heap_state_t *owner = lock_owner(sb);
+    *(void **)ptr = sb->free_objects;
+    sb->free_objects = ptr;
+    sb->in_use--;
+    owner->in_use -= class_sizes[sb->size_class];
+    owner->counters.frees++;
+    regroup(owner, sb);
+
+    if (owner == GLOBAL_HEAP) {
+        if (sb->in_use == 0) {
+            disown_superblock(owner, sb);
+            release_run(sb);
+        }
+    } else {
+        while (too_empty(owner) && shed_superblock(owner)) {
+        }
+    }
+    pthread_mutex_unlock(&owner->lock);
+}
+
+/* Function: large_alloc
+ * ---------------------
+ * Gives a request above MAX_SMALL a run of slots of its own, whose first
+ * slot is a multiple of the given alignment (at least SB_SIZE). Slots
+ * skipped to reach the alignment are given back. If dirty isn't NULL, it
+ * is set to how many bytes at the start of the block may hold old data.
+ */
+static void *large_alloc(size_t requestedsz, size_t alignment, size_t *dirty) {
+    size_t length = roundup(requestedsz, SB_SIZE) >> SB_SHIFT;
+    size_t extra = (alignment >> SB_SHIFT) - 1;
+    if (length + extra > nslots) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&GLOBAL_HEAP->lock);
+    superblock_t *head = take_run(length + extra);
+    if (head != NULL) {
+        size_t skip = (roundup((uintptr_t)slot_address(head), alignment) - (uintptr_t)slot_address(head)) >> SB_SHIFT;
+        mark_run(head + skip, length, RUN_LARGE);
+
+        // The block is marked first, so the pieces around it merge only with their other neighbours
+        if (extra > skip) {
+            mark_run(head + skip + length, extra - skip, RUN_LARGE);
+            release_run(head + skip + length);
+        }
+        if (skip > 0) {
+            mark_run(head, skip, RUN_LARGE);
+            release_run(head);
+        }
+        head += skip;
+
+        // Slots given back above the block stay above the mark, since nothing was written to them
+        size_t written = touch_run(head, length);
+        if (dirty != NULL) {
+            *dirty = written;
+        }
+        GLOBAL_HEAP->large += length * SB_SIZE;
+        GLOBAL_HEAP->counters.mallocs++;
+    }
+    pthread_mutex_unlock(&GLOBAL_HEAP->lock);
+    return head != NULL ? slot_address(head) : NULL;
+}
+
+/* Function: large_free
+ * --------------------
+ * Gives a large run back to the free slots.
+ */
+static void large_free(superblock_t *head) {
+    pthread_mutex_lock(&GLOBAL_HEAP->lock);
+    GLOBAL_HEAP->large -= head->length * SB_SIZE;
+    GLOBAL_HEAP->counters.frees++;
+    release_run(head);
+    pthread_mutex_unlock(&GLOBAL_HEAP->lock);
+}
+
+
+/* Function: myinit
+ * ----------------
+ * This function lines slots up with the first multiple of SB_SIZE in the
+ * segment and puts the descriptor table right after the last slot. The
+ * table is only written as slots are put to use, so a fresh segment is
+ * never touched beyond what is allocated. Every heap starts out empty.
+ */
+bool myinit(void *start, size_t size) {
+    if (start == NULL) {
+        return false;
+    }
+    char *base = (char *)roundup((uintptr_t)start, SB_SIZE);
+    if ((char *)start + size < base) {
+        return false;
+    }
+    nslots = ((char *)start + size - base) / (SB_SIZE + sizeof(superblock_t));
+    if (nslots == 0) {
+        return false;
+    }
+
+    // Forgets the clean mark only for a new segment. A reused one may be dirty
+    // below it, and above it too if the old descriptor table sat there
+    if (base != sb_base) {
+        nclean = 0;
+    } else if (descriptors != (superblock_t *)(base + (nslots << SB_SHIFT))) {
+        nclean = nslots;
+    }
+    sb_base = base;
+    descriptors = (superblock_t *)(base + (nslots << SB_SHIFT));
+    ncarved = 0;
+    free_runs = NULL;
+
+    memset(heaps, 0, sizeof(heaps));
+    for (size_t i = 0; i <= NUM_HEAPS; i++) {
+        pthread_mutex_init(&heaps[i].lock, NULL);
+    }
+    for (size_t sz = 0, index = 0; sz <= MAX_SMALL; sz += 8) {
+        if (sz > class_sizes[index]) {
+            index++;
+        }
+        class_of[sz >> 3] = (unsigned char)index;
+    }
+    next_heap = 0;
+    heap_epoch++;
+    return true;
+}
+
+/* Function: mymalloc
+ * ------------------
+ * This function takes a small object from the thread's heap under that
+ * heap's lock, which other threads only take to free into its
+ * superblocks, and gives larger requests a run of slots.
+ */
+void *mymalloc(size_t requestedsz) {
+    if (requestedsz == 0 || requestedsz > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    if (requestedsz > MAX_SMALL) {
+        return large_alloc(requestedsz, SB_SIZE, NULL);
+    }
+
+    heap_state_t *heap = current_heap();
+    pthread_mutex_lock(&heap->lock);
+    void *ptr = small_alloc(heap, class_of[roundup(requestedsz, 8) >> 3], NULL);
+    pthread_mutex_unlock(&heap->lock);
+    return ptr;
+}
+
+/* Function: myaligned_alloc
+ * -------------------------
+ * Objects start on multiples of their class size within a slot, and slots
+ * start on multiples of SB_SIZE. So this function serves a small request
+ * from the smallest class that is a multiple of the alignment, and a large
+ * one from a run of slots aligned as needed.
+ */
+void *myaligned_alloc(size_t alignment, size_t requestedsz) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return mymalloc(requestedsz);
+    }
+    if (requestedsz == 0 || requestedsz > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    size_t needed = roundup(requestedsz, alignment);
+    if (needed > MAX_SMALL) {
+        return large_alloc(requestedsz, alignment > SB_SIZE ? alignment : SB_SIZE, NULL);
+    }
+
+    // The classes include every power of two up to MAX_SMALL, so this stops
+    size_t index = class_of[needed >> 3];
+    while (class_sizes[index] % alignment != 0) {
+        index++;
+    }
+    heap_state_t *heap = current_heap();
+    pthread_mutex_lock(&heap->lock);
+    void *ptr = small_alloc(heap, index, NULL);
+    pthread_mutex_unlock(&heap->lock);
+    return ptr;
+}
+
+/* Function: mycalloc
+ * ------------------
+ * This function rejects requests whose total size overflows, then zeroes
+ * only the part of the block that may hold old data. An object carved from
+ * a superblock formatted in a never-written slot needs nothing, and a
+ * large run only needs its slots below the clean mark.
+ */
+void *mycalloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    size_t total = nmemb * size;
+    if (total == 0 || total > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    void *ptr;
+    size_t dirty;
+    if (total > MAX_SMALL) {
+        ptr = large_alloc(total, SB_SIZE, &dirty);
+    } else {
+        heap_state_t *heap = current_heap();
+        pthread_mutex_lock(&heap->lock);
+        ptr = small_alloc(heap, class_of[roundup(total, 8) >> 3], &dirty);
+        pthread_mutex_unlock(&heap->lock);
+    }
+    if (ptr != NULL) {
+        memset(ptr, 0, dirty < total ? dirty : total);
+    }
+    return ptr;
+}
+
+/* Function: mymalloc_batch
+ * ------------------------
+ * This function takes all the small objects of a batch under a single
+ * acquisition of the thread's heap lock, and large ones one at a time.
+ */
+size_t mymalloc_batch(size_t size, size_t n, void *out[]) {
+    size_t done = 0;
+    if (size == 0 || size > MAX_SMALL) {
+        for (; done < n; done++) {
+            out[done] = mymalloc(size);
+            if (out[done] == NULL) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    heap_state_t *heap = current_heap();
+    size_t index = class_of[roundup(size, 8) >> 3];
+    pthread_mutex_lock(&heap->lock);
+    for (; done < n; done++) {
+        out[done] = small_alloc(heap, index, NULL);
+        if (out[done] == NULL) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return done;
+}
+
+/* Function: myusable_size
+ * -----------------------
+ * This function returns the class size of a small object, or the bytes
+ * in a large block's run of slots.
+ */
+size_t myusable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    superblock_t *sb = slot_of(ptr);
+    if (sb->kind == RUN_SMALL) {
+        return class_sizes[sb->size_class];
+    }
+    return sb->length * SB_SIZE;
+}
+
+/* Function: myfree
+ * ----------------
+ * This function returns a small object to its superblock under the lock
+ * of the heap that owns it, whichever thread calls, and gives a large
+ * block's run back to the free slots.
+ */
+void myfree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    superblock_t *sb = slot_of(ptr);
+    if (sb->kind == RUN_SMALL) {
+        small_free(sb, ptr);
+    } else {
+        large_free(sb);
+    }
+}
+
+/* Function: myfree_sized
+ * ----------------------
+ * The slot's descriptor already says how big the block is, so this
+ * function only checks the size in debug builds and calls myfree.
+ */
+void myfree_sized(void *ptr, size_t size) {
+    assert(ptr == NULL || size <= myusable_size(ptr)); // size doesn't match the block
+    myfree(ptr);
+}
+
+/* Function: myfree_batch
+ * ----------------------
+ * This function frees the blocks one at a time with myfree, since each
+ * one may belong to a different heap.
+ */
+void myfree_batch(void *ptrs[], size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        myfree(ptrs[i]);
+    }
+}
+
+/* Function: myrealloc
+ * -------------------
+ * This function keeps a small object in place while the new size fits its
+ * class. A large block shrinks in place, giving back the slots it no
+ * longer needs, and grows in place into a free run or the untouched slots
+ * right after it. Anything else moves to a new block.
+ */
+void *myrealloc(void *oldptr, size_t newsz) {
+    if (oldptr == NULL) {
+        return mymalloc(newsz);
+    }
+    if (newsz == 0) {
+        myfree(oldptr);
+        return NULL;
+    }
+    if (newsz > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    superblock_t *head = slot_of(oldptr);
+    size_t oldsz = myusable_size(oldptr);
+    bool in_place = newsz <= oldsz;
+    if (head->kind == RUN_LARGE) {
+        size_t index = head - descriptors;
+        size_t length = head->length;
+        size_t wanted = roundup(newsz, SB_SIZE) >> SB_SHIFT;
+
+        pthread_mutex_lock(&GLOBAL_HEAP->lock);
+        superblock_t *next = head + length;
+        if (wanted < length) {
+            mark_run(head, wanted, RUN_LARGE);
+            mark_run(head + wanted, length - wanted, RUN_LARGE);
+            release_run(head + wanted);
+            GLOBAL_HEAP->counters.splits++;
+        } else if (wanted > length && index + length == ncarved && index + wanted <= nslots) {
+            ncarved = index + wanted;
+            touch_run(head, wanted);
+            mark_run(head, wanted, RUN_LARGE);
+            in_place = true;
+        } else if (wanted > length && index + length < ncarved && next->kind == RUN_FREE &&
+                   length + next->length >= wanted) {
+            size_t spare = length + next->length - wanted;
+            remove_run(next);
+            if (spare > 0) {
+                push_run(head + wanted, spare);
+            }
+            mark_run(head, wanted, RUN_LARGE);
+            GLOBAL_HEAP->counters.coalesces++;
+            in_place = true;
+        }
+        GLOBAL_HEAP->large += (head->length - length) * SB_SIZE;
+        pthread_mutex_unlock(&GLOBAL_HEAP->lock);
+    }
+
+    void *newptr = oldptr;
+    if (!in_place) {
+        newptr = mymalloc(newsz);
+        if (newptr == NULL) {
+            return NULL;
+        }
+        memcpy(newptr, oldptr, oldsz);
+        myfree(oldptr);
+    }
+    __atomic_add_fetch(&GLOBAL_HEAP->counters.reallocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(in_place ? &GLOBAL_HEAP->counters.reallocs_in_place : &GLOBAL_HEAP->counters.reallocs_moved,
+                       1, __ATOMIC_RELAXED);
+    return newptr;
+}
+
+/* Function: mystats
+ * -----------------
+ * This function sums the counters of every heap, taking each lock in
+ * turn. Free space is the room left in superblocks plus the free runs and
+ * the untouched slots, each run counting as one free block.
+ */
+void mystats(struct heap_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i <= NUM_HEAPS; i++) {
+        heap_state_t *heap = &heaps[i];
+        pthread_mutex_lock(&heap->lock);
+        stats->bytes_in_use += heap->in_use + heap->large;
+        stats->bytes_free += heap->held - heap->in_use;
+        stats->mallocs += heap->counters.mallocs;
+        stats->frees += heap->counters.frees;
+        stats->reallocs += heap->counters.reallocs;
+        stats->reallocs_in_place += heap->counters.reallocs_in_place;
+        stats->reallocs_moved += heap->counters.reallocs_moved;
+        stats->splits += heap->counters.splits;
+        stats->coalesces += heap->counters.coalesces;
+        if (heap == GLOBAL_HEAP) {
+            for (superblock_t *head = free_runs; head != NULL; head = head->next) {
+                size_t bytes = head->length * SB_SIZE;
+                stats->bytes_free += bytes;
+                stats->free_blocks++;
+                if (bytes > stats->largest_free) {
+                    stats->largest_free = bytes;
+                }
+            }
+            if (ncarved < nslots) {
+                stats->bytes_free += (nslots - ncarved) * SB_SIZE;
+                stats->free_blocks++;
+                if ((nslots - ncarved) * SB_SIZE > stats->largest_free) {
+                    stats->largest_free = (nslots - ncarved) * SB_SIZE;
+                }
+            }
+        }
+        pthread_mutex_unlock(&heap->lock);
+    }
+}
+
+/* Function: validate_heap
+ * -----------------------
+ * This function walks every heap's groups to check each superblock is
+ * filed under the right owner, class and group, that its free list holds
+ * exactly the objects not in use, and that the heap's counts add up. The
+ * emptiness invariant isn't checked, since only frees restore it and a
+ * malloc that starts a new class may break it for a while. It then walks
+ * the runs below ncarved to check their first and last slots agree, that
+ * no two free runs are adjacent, that none of them reach past the clean
+ * mark, and that the superblocks, large runs and free list account for
+ * all of them.
+ */
+bool validate_heap() {
+    size_t nsuperblocks = 0;
+    for (size_t i = 0; i <= NUM_HEAPS; i++) {
+        heap_state_t *heap = &heaps[i];
+        size_t in_use = 0;
+        size_t held = 0;
+        for (size_t index = 0; index < NUM_CLASSES; index++) {
+            for (int g = 0; g <= FULL_GROUP; g++) {
+                superblock_t *prev = NULL;
+                for (superblock_t *sb = heap->groups[index][g]; sb != NULL; sb = sb->next) {
+                    if (sb->kind != RUN_SMALL || sb->owner != heap || sb->size_class != index ||
+                        sb->group != g || group_of(sb) != g || sb->prev != prev ||
+                        sb->in_use > sb->carved || sb->carved > capacity(index)) {
+                        printf("Superblock %p is misfiled in heap %zu\n", slot_address(sb), i);
+                        breakpoint();
+                        return false;
+                    }
+                    if (heap == GLOBAL_HEAP && sb->in_use == 0) {
+                        printf("Global heap holds empty superblock %p\n", slot_address(sb));
+                        breakpoint();
+                        return false;
+                    }
+
+                    size_t nfree = 0;
+                    char *start = slot_address(sb);
+                    for (char *obj = sb->free_objects; obj != NULL && nfree <= sb->carved; obj = *(char **)obj) {
+                        if (obj < start || obj >= start + (size_t)sb->carved * class_sizes[index] ||
+                            (size_t)(obj - start) % class_sizes[index] != 0) {
+                            printf("Free object %p is outside its superblock %p\n", obj, start);
+                            breakpoint();
+                            return false;
+                        }
+                        nfree++;
+                    }
+                    if (nfree != sb->carved - sb->in_use) {
+                        printf("Superblock %p has %zu free objects but counts %u\n",
+                            start, nfree, sb->carved - sb->in_use);
+                        breakpoint();
+                        return false;
+                    }
+                    in_use += (size_t)sb->in_use * class_sizes[index];
+                    held += SB_SIZE;
+                    nsuperblocks++;
+                    prev = sb;
+                }
+            }
+        }
+        if (in_use != heap->in_use || held != heap->held) {
+            printf("Heap %zu holds %zu/%zu bytes in use but counts %zu/%zu\n",
+                i, in_use, held, heap->in_use, heap->held);
+            breakpoint();
+            return false;
+        }
+    }
+
+    size_t nsmall = 0;
+    size_t large = 0;
+    size_t nfree_runs = 0;
+    bool prev_free = false;
+    for (size_t index = 0; index < ncarved; index += descriptors[index].length) {
+        superblock_t *head = &descriptors[index];
+        superblock_t *tail = head + head->length - 1;
+        if (head->length == 0 || index + head->length > ncarved ||
+            tail->length != head->length || tail->kind != head->kind ||
+            (head->kind == RUN_FREE && prev_free)) {
+            printf("Run at slot %zu is corrupt or follows another free run\n", index);
+            breakpoint();
+            return false;
+        }
+        if (head->kind == RUN_SMALL) {
+            nsmall++;
+        } else if (head->kind == RUN_LARGE) {
+            large += head->length * SB_SIZE;
+        } else {
+            nfree_runs++;
+        }
+        prev_free = (head->kind == RUN_FREE);
+    }
+    if (prev_free) {
+        printf("Free run left below the untouched slots at %zu\n", ncarved);
+        breakpoint();
+        return false;
+    }
+    if (ncarved > nclean) {
+        printf("Used slots reach %zu, past the clean mark at %zu\n", ncarved, nclean);
+        breakpoint();
+        return false;
+    }
+
+    size_t nlisted = 0;
+    superblock_t *prev = NULL;
+    for (superblock_t *head = free_runs; head != NULL; head = head->next) {
+        if (head->kind != RUN_FREE || head->prev != prev) {
+            printf("Run at slot %zu is misplaced on the free list\n", (size_t)(head - descriptors));
+            breakpoint();
+            return false;
+        }
+        prev = head;
+        nlisted++;
+    }
+    if (nsmall != nsuperblocks || large != GLOBAL_HEAP->large || nlisted != nfree_runs) {
+        printf("Slots hold %zu superblocks, %zu large bytes and %zu free runs, "
+               "but heaps hold %zu, %zu and the list %zu\n",
+            nsmall, large, nfree_runs, nsuperblocks, GLOBAL_HEAP->large, nlisted);
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+/* Function: dump_heap
+ * -------------------
+ * This function prints each heap's counts and the superblocks it holds
+ * per class, followed by the runs of slots, which is handy to call from
+ * gdb.
+ */
+void dump_heap() {
+    printf("Slots start at address %p, %zu of %zu used.\n", sb_base, ncarved, nslots);
+    for (size_t i = 0; i <= NUM_HEAPS; i++) {
+        heap_state_t *heap = &heaps[i];
+        printf("heap %zu: %zu of %zu bytes in use\n", i, heap->in_use, heap->held);
+        for (size_t index = 0; index < NUM_CLASSES; index++) {
+            for (int g = 0; g <= FULL_GROUP; g++) {
+                for (superblock_t *sb = heap->groups[index][g]; sb != NULL; sb = sb->next) {
+                    printf("  class %u group %d: %p, %u of %u objects in use\n",
+                        class_sizes[index], g, slot_address(sb), sb->in_use, capacity(index));
+                }
+            }
+        }
+    }
+    for (size_t index = 0; index < ncarved; index += descriptors[index].length) {
+        superblock_t *head = &descriptors[index];
+        printf("%p: %u slot(s) %s\n", slot_address(head), head->length,
+            head->kind == RUN_FREE ? "free" : head->kind == RUN_SMALL ? "superblock" : "large");
+    }
+}
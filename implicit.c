@@ -1,35 +1,227 @@
 #include "allocator.h"
 #include "debug_break.h"
+#include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 /* 
   IMPLEMENTATION 
   This allocator uses an implicit free list design where each block contains
   a header with size information and allocation status. The heap is managed
   as a single contiguous region with blocks laid out sequentially, and the 
-  heap uses a first-fit traversal allocation strategy. You can find more detailed 
-  information of the implementation on the readme file. 
+  heap uses a first-fit traversal allocation strategy. Building with -DNEXT_FIT
+  switches to next-fit instead: the traversal resumes from a roving pointer left
+  just past the last allocation and wraps around at the end of the heap. You can
+  find more detailed information of the implementation on the readme file. 
  
   Block Format:
   - Header (8 bytes): Contains payload size and allocation bit (LSB)
   - Payload: User data space
+
+  Requests of up to BIBOP_MAX_OBJECT bytes skip the header entirely and are
+  served from "big bag of pages" pages (see below). 
+
+  The heap walk doesn't hop from header to header. A bitmap kept past the end
+  of the heap has one bit per 8-byte granule, set exactly where a free block
+  starts, so the walk streams through the bitmap to jump straight from one
+  free block to the next (see FREE BLOCK BITMAP below). A tree of maxima
+  over the bitmap keeps the largest free block at hand for heap_stats (see
+  LARGEST FREE BLOCK below). 
  */
 
 
-// Global heap management variables 
-static void *heapStart; // Pointer to the beginning of heap region 
-static size_t heapSize; // Total size of heap in bytes 
-static size_t sizeUsed; // Total bytes currently allocated 
+// Small-object pages and the object sizes they serve (see BIG BAG OF PAGES below) 
+#define BIBOP_PAGE_SIZE 4096
+#define BIBOP_PAGE_SHIFT 12
+#define BIBOP_MAX_OBJECT 32
+#define NUM_BIBOP_CLASSES (BIBOP_MAX_OBJECT / 8) // one class per multiple of 8 bytes 
+
+// Most levels the tree of largest free payloads can have, enough for 2^48 bitmap words 
+#define TREE_LEVELS 8
+
+// State of one heap, which heap_create keeps at the front of its segment 
+struct heap {
+    void *heapStart; // Pointer to the beginning of heap region 
+    size_t heapSize; // Total size of heap in bytes 
+    size_t sizeUsed; // Total bytes currently allocated 
+    size_t rover; // Offset of the block header the next-fit traversal starts from 
+    unsigned char *zeroMark; // Nothing at or above this address has ever been written 
+    struct heap_stats counters; // Running totals reported by heap_stats 
+    uint64_t *freeMap; // One bit per granule, set at each free block header 
+    size_t mapClean; // Number of words of freeMap that have been initialized 
+    size_t *largestTree[TREE_LEVELS]; // Level k holds the largest free payload starting under each 64^k words of freeMap 
+    size_t treeClean[TREE_LEVELS]; // Number of entries of each level that have been initialized 
+    size_t treeLevels; // Levels in use, the last of which has a single entry 
+    unsigned char *pageMap; // Size class + 1 of each small-object page, 0 for other pages 
+    struct bibop_page *partialPages[NUM_BIBOP_CLASSES]; // Pages with at least one free object 
+};
+
+// Heap behind the mymalloc family 
+static heap_t defaultHeap;
 
 // This function rounds up the size to the nearest mutliple of eight
 size_t roundup(size_t number) {
     return (number + 8 - 1) & ~(8 - 1);
 }
 
+/* 
+  FREE BLOCK BITMAP 
+  Bit g of freeMap is set when a free block header sits at byte offset 8 * g
+  of the heap, and clear everywhere else. Searching for free space is then a
+  search for the next set bit: whole words of zeros (runs of allocated blocks)
+  are skipped 64 granules at a time, or 128/256 at a time with SSE2/AVX2 when
+  the compiler targets them (-mavx2 selects the AVX2 path). 
+
+  The bitmap covers the whole heap, so it is only cleared lazily: the words
+  below mapClean are valid and the ones above it have never been touched. No
+  bit can be set above mapClean, so the search stops there. 
+ */ 
+
+/* 
+  LARGEST FREE BLOCK 
+  Entry w of level 0 of largestTree is the largest payload of the free
+  blocks whose headers lie in word w of freeMap (a 512-byte stretch of the
+  heap), and entry j of level k is the largest of entries 64j to 64j+63 of
+  level k-1. The single entry of the last level is the largest free block.
+  Whenever a free block starts, ends or changes size, its word is rescanned
+  and the change goes up the levels until an entry comes out unchanged. A
+  parent is only rescanned when its largest child shrank. Like the bitmap,
+  each level is cleared lazily, and entries at or above treeClean read as 0. 
+ */ 
+
+// This function returns an entry of the tree, 0 for one that hasn't been initialized 
+static size_t treeEntry(heap_t *heap, size_t level, size_t index) {
+    return index < heap->treeClean[level] ? heap->largestTree[level][index] : 0;
+}
+
+// This function sets an entry of the tree, first clearing the entries below it that haven't been initialized 
+static void setTreeEntry(heap_t *heap, size_t level, size_t index, size_t value) {
+    if (index >= heap->treeClean[level]) {
+        memset(heap->largestTree[level] + heap->treeClean[level], 0, (index - heap->treeClean[level]) * sizeof(size_t));
+        heap->treeClean[level] = index + 1;
+    }
+    heap->largestTree[level][index] = value;
+}
+
+// This function updates the tree after the free blocks starting in header's word of freeMap changed 
+static void refreshLargest(heap_t *heap, size_t *header) {
+    size_t w = ((unsigned char *)header - (unsigned char *)heap->heapStart) >> 9;
+    size_t best = 0;
+    for (uint64_t bits = (w < heap->mapClean) ? heap->freeMap[w] : 0; bits != 0; bits &= bits - 1) {
+        size_t *free = (size_t *)heap->heapStart + (w << 6) + __builtin_ctzll(bits);
+        if (*free > best) {
+            best = *free;
+        }
+    }
+
+    for (size_t level = 0; level < heap->treeLevels; level++) {
+        size_t old = treeEntry(heap, level, w);
+        if (old == best) {
+            return;
+        }
+        setTreeEntry(heap, level, w, best);
+        if (level + 1 == heap->treeLevels) {
+            return;
+        }
+
+        // The parent takes a bigger value as is, and only needs its children rescanned if its largest one shrank 
+        size_t parent = treeEntry(heap, level + 1, w >> 6);
+        if (best < parent) {
+            if (old < parent) {
+                return;
+            }
+            for (size_t j = w & ~(size_t)63; j < (w | 63) + 1; j++) {
+                size_t child = treeEntry(heap, level, j);
+                if (child > best) {
+                    best = child;
+                }
+            }
+        }
+        w >>= 6;
+    }
+}
+
+// This function records that a free block starts at header 
+static void markFree(heap_t *heap, size_t *header) {
+    size_t g = ((unsigned char *)header - (unsigned char *)heap->heapStart) >> 3;
+    size_t w = g >> 6;
+    if (w >= heap->mapClean) {
+        memset(heap->freeMap + heap->mapClean, 0, (w + 1 - heap->mapClean) * sizeof(uint64_t));
+        heap->mapClean = w + 1;
+    }
+    heap->freeMap[w] |= (uint64_t)1 << (g & 63);
+
+    // Keeps the free block counters reported by heap_stats 
+    heap->counters.free_blocks++;
+    refreshLargest(heap, header);
+}
+
+// This function records that header no longer starts a free block 
+static void markUsed(heap_t *heap, size_t *header) {
+    size_t g = ((unsigned char *)header - (unsigned char *)heap->heapStart) >> 3;
+    size_t w = g >> 6;
+    if (w < heap->mapClean) {
+        heap->freeMap[w] &= ~((uint64_t)1 << (g & 63));
+    }
+
+    // Keeps the free block counters reported by heap_stats 
+    heap->counters.free_blocks--;
+    refreshLargest(heap, header);
+}
+
+// This function returns whether a free block starts at header 
+static bool isMarkedFree(heap_t *heap, size_t *header) {
+    size_t g = ((unsigned char *)header - (unsigned char *)heap->heapStart) >> 3;
+    size_t w = g >> 6;
+    return w < heap->mapClean && ((heap->freeMap[w] >> (g & 63)) & 1);
+}
+
+// This function returns the offset of the first free block at or after offset i, or heapSize if there is none 
+static size_t nextFreeBlock(heap_t *heap, size_t i) {
+    size_t g = i >> 3;
+    size_t w = g >> 6;
+    if (w >= heap->mapClean) {
+        return heap->heapSize;
+    }
+
+    // Drops the bits of the first word that lie before i 
+    uint64_t bits = heap->freeMap[w] & (~(uint64_t)0 << (g & 63));
+    while (bits == 0) {
+        w++;
+
+        // Skips over several all-zero words per step 
+#if defined(__AVX2__)
+        while (w + 4 <= heap->mapClean) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(heap->freeMap + w));
+            if (!_mm256_testz_si256(v, v)) {
+                break;
+            }
+            w += 4;
+        }
+#elif defined(__SSE2__)
+        while (w + 2 <= heap->mapClean) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(heap->freeMap + w));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF) {
+                break;
+            }
+            w += 2;
+        }
+#endif
+        if (w >= heap->mapClean) {
+            return heap->heapSize;
+        }
+        bits = heap->freeMap[w];
+    }
+    return ((w << 6) + __builtin_ctzll(bits)) << 3;
+}
+
 // This function splits up a block if it's significantly larger than the requested size. 
-void splitFunc(size_t *used, size_t *h, size_t payload, size_t requested_size) {
+void splitFunc(heap_t *heap, size_t *used, size_t *h, size_t payload, size_t requested_size) {
     /* - Creates a new free block from the remaining space. 
        - Split only occurs if the remainder is at least 16 bytes (8-bytes for the 
          header + 8-bytes required for the minimum payload) 
@@ -43,6 +235,8 @@ void splitFunc(size_t *used, size_t *h, size_t payload, size_t requested_size) {
 
         // Sets up new free block with the remaining space 
         *split = payload - (requested_size + 8); 
+        markFree(heap, split);
+        heap->counters.splits++;
 
         // Updates original block to the requested size 
         *h = requested_size; // size requested by user 
@@ -50,96 +244,635 @@ void splitFunc(size_t *used, size_t *h, size_t payload, size_t requested_size) {
     }
 } 
 
-// This function initializes the heap allocator with the given memory region 
-bool myinit(void *heap_start, size_t heap_size) {
+// This function gives the part of an allocated block beyond requested_size back to the heap 
+static void releaseTail(heap_t *heap, size_t *h, size_t requested_size) {
+    /* - The leftover is merged into the right neighbour if that block is free 
+       - Otherwise it becomes a free block of its own if it is at least 16 bytes 
+    */ 
+    size_t payload = *h ^ 1;
+    size_t surplus = payload - requested_size;
+    unsigned char *next_address = (unsigned char *)h + 8 + payload;
+    size_t *next = (size_t *)next_address;
+    bool nextFree = next_address < (unsigned char *)heap->heapStart + heap->heapSize && (*next & 1) == 0;
+
+    if (surplus == 0 || (!nextFree && surplus < 16)) {
+        return;
+    }
+
+    // Sets up the new free block, absorbing the free neighbour when there is one 
+    size_t *split = (size_t *)((unsigned char *)h + 8 + requested_size);
+    size_t split_payload = surplus - 8;
+    if (nextFree) {
+        split_payload += (8 + *next);
+        markUsed(heap, next);
+        heap->counters.coalesces++;
+    }
+    *split = split_payload;
+    markFree(heap, split);
+    heap->counters.splits++;
+
+    // The rover can't point into the middle of the merged block 
+    if (nextFree && heap->rover == (size_t)(next_address - (unsigned char *)heap->heapStart)) {
+        heap->rover = (unsigned char *)split - (unsigned char *)heap->heapStart;
+    }
+
+    // Updates original block to the requested size and keeps it allocated 
+    *h = requested_size ^ 1;
+    heap->sizeUsed -= surplus;
+}
+
+// This function merges the free block at header with every free block that directly follows it 
+static void coalesceFree(heap_t *heap, size_t *header) {
+    /* - Blocks have no footer, so only the right-hand neighbours can be reached
+         from a block. Runs that a free leaves behind on the left get merged
+         later, when the heap walk reaches the first block of the run 
+       - The rover is moved back if the block it points at is absorbed 
+    */ 
+    unsigned char *heapEnd = (unsigned char *)heap->heapStart + heap->heapSize;
+    unsigned char *next_address = (unsigned char *)header + 8 + *header;
+    size_t payload = *header;
+
+    while (next_address < heapEnd && (*(size_t *)next_address & 1) == 0) {
+        if (heap->rover == (size_t)(next_address - (unsigned char *)heap->heapStart)) {
+            heap->rover = (unsigned char *)header - (unsigned char *)heap->heapStart;
+        }
+        markUsed(heap, (size_t *)next_address);
+        *header += 8 + *(size_t *)next_address;
+        next_address = (unsigned char *)header + 8 + *header;
+        heap->counters.coalesces++;
+    }
+    if (*header != payload) {
+        refreshLargest(heap, header);
+    }
+}
+
+// This function raises the high-water mark past an allocated block and the header that may follow it 
+static void raiseMark(heap_t *heap, size_t *header) {
+    unsigned char *end = (unsigned char *)header + 8 + (*header & ~(size_t)1) + 8;
+    if (end > heap->zeroMark) {
+        heap->zeroMark = end;
+    }
+}
+
+// This function finds a free block with room for requested_size bytes, or returns NULL 
+static size_t *findFit(heap_t *heap, size_t requested_size) {
+    /* - First-fit starts every traversal at the beginning of the heap 
+       - Next-fit starts at the rover and wraps around at heapSize, so the
+         traversal still visits every free block once before giving up. It
+         looks at far fewer blocks, but leaves the holes behind the rover
+         unused until it wraps, which costs a lot of utilization 
+       - Each free block is merged with the free blocks after it before it is
+         checked, so the walk never fails while a large enough run exists. A
+         merge can swallow the starting block, which is why the walk stops once
+         it is back at or past the start rather than exactly on it 
+    */ 
+#ifdef NEXT_FIT
+    size_t start = heap->rover;
+#else
+    size_t start = 0;
+#endif
+    size_t i = start;
+    bool wrapped = false;
+
+    while (true) {
+        // Jumps straight to the next free block, wrapping back to the start of the heap 
+        i = nextFreeBlock(heap, i);
+        if (i >= heap->heapSize) {
+            if (wrapped || start == 0) {
+                return NULL;
+            }
+            i = 0;
+            wrapped = true;
+            continue;
+        }
+        if (wrapped && i >= start) {
+            return NULL;
+        }
+
+        // Checks if the payload is large enough 
+        unsigned char *newIndex = (unsigned char *)heap->heapStart + i;
+        size_t *header = (size_t *)newIndex;
+        coalesceFree(heap, header);
+        if (requested_size <= *header) {
+            return header;
+        }
+        i += 8 + *header;
+    }
+}
+
+// This function allocates requested_size bytes from the free block at header 
+static void *placeBlock(heap_t *heap, size_t *header, size_t requested_size) {
+    size_t payload = *header;
+    size_t used = 8 + payload;
+
+    // Takes the block off the bitmap before the split files its remainder 
+    markUsed(heap, header);
+
+    // Checks block and split if significantly larger than needed 
+    if ((payload - requested_size) >= 16) {
+        splitFunc(heap, &used, header, payload, requested_size);
+    }
+    *header ^= 1;
+    heap->sizeUsed += used; 
+    raiseMark(heap, header);
+
+    // Leaves the rover on the block right after this one 
+    heap->rover = ((unsigned char *)header - (unsigned char *)heap->heapStart) + used;
+    if (heap->rover >= heap->heapSize) {
+        heap->rover = 0;
+    }
+
+    // Returns pointer to payload (skip header) 
+    unsigned char *payload_address = (unsigned char *)header + 8;
+    return payload_address;
+}
+
+// This function frees a block that has a header by clearing its allocation bit 
+static void freeBlock(heap_t *heap, void *ptr) {
+    // Finds header by going back 8 bytes from payload 
+    unsigned char *h = (unsigned char *)ptr - 8;
+    size_t *header = (size_t *)h; 
+
+    // Clears allocation bit to mark it as free 
+    *header ^= 1; 
+
+    // Updates the heap's usage counter 
+    heap->sizeUsed -= (*header + 8);
+    markFree(heap, header);
+
+    // Merges with the free blocks to the right straight away 
+    coalesceFree(heap, header);
+}
+
+// This function carves a block whose payload starts offset bytes past a multiple of alignment (a power of two) 
+static void *allocateAligned(heap_t *heap, size_t requested_size, size_t alignment, size_t offset) {
+    // Traverses the free blocks to find the first one that can hold the aligned payload 
+    for (size_t i = nextFreeBlock(heap, 0); i < heap->heapSize; i = nextFreeBlock(heap, i)) {
+        unsigned char *start = (unsigned char *)heap->heapStart + i;
+        size_t *header = (size_t *)start;
+        coalesceFree(heap, header);
+        size_t payload = *header;
+
+        // Anything in front of the aligned payload must be big enough to remain a free block 
+        unsigned char *ptr = start + 8;
+        unsigned char *aligned = (unsigned char *)((((uintptr_t)ptr - offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) + offset);
+        while (aligned != ptr && (size_t)(aligned - ptr) < 16) {
+            aligned += alignment;
+        }
+        unsigned char *end = ptr + payload;
+
+        if (aligned + requested_size <= end) {
+            if (aligned != ptr) {
+                *header = aligned - ptr - 8; // the prefix stays free 
+                refreshLargest(heap, header);
+                heap->counters.splits++;
+            } else {
+                markUsed(heap, header);
+            }
+
+            // Takes the rest of the block, then gives back what lies past the request 
+            size_t *aligned_header = (size_t *)(aligned - 8);
+            *aligned_header = (end - aligned) ^ 1;
+            heap->sizeUsed += (end - aligned + 8);
+            releaseTail(heap, aligned_header, requested_size);
+            raiseMark(heap, aligned_header);
+            return aligned;
+        }
+
+        i += 8 + payload; // Moves past this block 
+    }
+    return NULL;
+}
+
+/* 
+  BIG BAG OF PAGES 
+  Small objects carry no header. Each one lives on a page given over to a
+  single size class: the page is an ordinary allocated block whose header
+  sits at the start of the page and which fills the page. The page map (one
+  byte per page of the heap, stored past the end of the heap) holds the size
+  class of every such page plus one, or 0 for ordinary pages, so myfree can
+  route a pointer from its address alone. Each page keeps a list of its free
+  objects, and each class keeps a list of its pages that still have room.
+ */ 
+
+// Start of each small-object page 
+typedef struct bibop_page {
+    size_t h; // the ordinary block header, covering the whole page 
+    struct bibop_page *next; // next page of this class with free objects 
+    struct bibop_page *prev; // previous page of this class with free objects 
+    void *freeObjects; // singly-linked list of free objects on this page 
+    size_t numFree; // number of objects on freeObjects 
+} bibop_page;
+
+// This function returns the page map entry for the page holding ptr 
+static unsigned char *pageEntry(heap_t *heap, void *ptr) {
+    return &heap->pageMap[((uintptr_t)ptr >> BIBOP_PAGE_SHIFT) - ((uintptr_t)heap->heapStart >> BIBOP_PAGE_SHIFT)];
+}
+
+// This function returns the object size of a small-object class 
+static size_t bibopSize(size_t index) {
+    return 8 * (index + 1);
+}
+
+// This function returns the number of objects that fit on a page of the given class 
+static size_t bibopCapacity(size_t index) {
+    return (BIBOP_PAGE_SIZE - sizeof(bibop_page)) / bibopSize(index);
+}
+
+// This function links a page onto the front of its class's list of pages with room 
+static void pushPartial(heap_t *heap, bibop_page *page, size_t index) {
+    page->prev = NULL;
+    page->next = heap->partialPages[index];
+    if (page->next != NULL) {
+        page->next->prev = page;
+    }
+    heap->partialPages[index] = page;
+}
+
+// This function unlinks a page from its class's list of pages with room 
+static void removePartial(heap_t *heap, bibop_page *page, size_t index) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        heap->partialPages[index] = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+}
+
+
+// This function hands out a headerless object from a page of the class that fits requested_size 
+static void *bibopAlloc(heap_t *heap, size_t requested_size) {
+    size_t index = (requested_size >> 3) - 1;
+    bibop_page *page = heap->partialPages[index];
+
+    if (page == NULL) {
+        // Carves a block whose header sits at the start of a page and which fills that page 
+        void *payload = allocateAligned(heap, BIBOP_PAGE_SIZE - 8, BIBOP_PAGE_SIZE, 8);
+        if (payload == NULL) {
+            return NULL;
+        }
+        page = (bibop_page *)((unsigned char *)payload - 8);
+        *pageEntry(heap, page) = index + 1;
+
+        // Threads every object onto the free list, lowest address first 
+        size_t objSize = bibopSize(index);
+        size_t capacity = bibopCapacity(index);
+        unsigned char *first = (unsigned char *)page + sizeof(bibop_page);
+        for (size_t i = 0; i < capacity; i++) {
+            *(void **)(first + i * objSize) = (i + 1 < capacity) ? first + (i + 1) * objSize : NULL;
+        }
+        page->freeObjects = first;
+        page->numFree = capacity;
+        pushPartial(heap, page, index);
+    }
+
+    void *ptr = page->freeObjects;
+    page->freeObjects = *(void **)ptr;
+    page->numFree--;
+
+    // A full page has nothing more to give, so it leaves the list 
+    if (page->numFree == 0) {
+        removePartial(heap, page, index);
+    }
+    return ptr;
+}
+
+// This function returns a headerless object to its page, and the page to the heap once it is empty 
+static void bibopFree(heap_t *heap, void *ptr, size_t index) {
+    bibop_page *page = (bibop_page *)((uintptr_t)ptr & ~(uintptr_t)(BIBOP_PAGE_SIZE - 1));
+    *(void **)ptr = page->freeObjects;
+    page->freeObjects = ptr;
+    page->numFree++;
+
+    if (page->numFree == 1) {
+        pushPartial(heap, page, index); // was full, has room again 
+    } else if (page->numFree == bibopCapacity(index) && (page->prev != NULL || page->next != NULL)) {
+        // Keeps the last page of a class around so alloc/free pairs don't churn pages 
+        removePartial(heap, page, index);
+        *pageEntry(heap, page) = 0;
+        page->h ^= 1;
+        heap->sizeUsed -= (page->h + 8);
+        markFree(heap, &page->h);
+        coalesceFree(heap, &page->h);
+    }
+}
+
+// This function sets up a heap's state for the region of heap_size bytes at heap_start 
+static bool initHeap(heap_t *heap, void *heap_start, size_t heap_size) {
     if (heap_start == NULL) {
         return false;
     }
     
-    // Initializes global heap state
-    heapStart = heap_start; // Pointer to the start of the heap memory 
-    heapSize = heap_size; // Total size of the heap in bytes 
+    // Reserves the page map at the top of the segment, one byte per page of heap, 
+    // followed by the free block bitmap, one bit per granule of heap, and the 
+    // levels of the largest free tree, each 64 times smaller than the last 
+    size_t mapSize = roundup((heap_size >> BIBOP_PAGE_SHIFT) + 2);
+    size_t mapWords = (heap_size >> 9) + 1;
+    size_t bitmapSize = mapWords * sizeof(uint64_t);
+    size_t levelSizes[TREE_LEVELS];
+    size_t levels = 0;
+    size_t treeSize = 0;
+    for (size_t entries = mapWords; levels == 0 || levelSizes[levels - 1] > 1; entries = (entries + 63) >> 6) {
+        levelSizes[levels++] = entries;
+        treeSize += entries * sizeof(size_t);
+    }
+    if (heap_size < mapSize + bitmapSize + treeSize + 16) {
+        return false;
+    }
+
+    // Forgets the high-water mark only for a new segment, since a reused one may be dirty below it 
+    if (heap_start != heap->heapStart || heap->zeroMark == NULL) {
+        heap->zeroMark = (unsigned char *)heap_start + 8;
+    }
+
+    // Initializes the heap's state
+    heap->heapStart = heap_start; // Pointer to the start of the heap memory 
+    heap->heapSize = (heap_size - mapSize - bitmapSize - treeSize) & ~(size_t)7; // Total size of the heap in bytes 
+    heap->pageMap = (unsigned char *)heap->heapStart + heap->heapSize;
+    memset(heap->pageMap, 0, mapSize);
+    heap->freeMap = (uint64_t *)(heap->pageMap + mapSize);
+    heap->mapClean = 0;
+    size_t *level = (size_t *)(heap->freeMap + mapWords);
+    for (size_t i = 0; i < levels; i++) {
+        heap->largestTree[i] = level;
+        heap->treeClean[i] = 0;
+        level += levelSizes[i];
+    }
+    heap->treeLevels = levels;
+    for (size_t i = 0; i < NUM_BIBOP_CLASSES; i++) {
+        heap->partialPages[i] = NULL;
+    }
 
     // Creates initial free block header spanning the entire heap 
-    size_t *header = (size_t *)heapStart;
-    *header = heapSize - 8; // payload size which is equal to the total size - header size
-    sizeUsed = 0;
+    memset(&heap->counters, 0, sizeof(heap->counters));
+    size_t *header = (size_t *)heap->heapStart;
+    *header = heap->heapSize - 8; // payload size which is equal to the total size - header size
+    markFree(heap, header);
+    heap->sizeUsed = 0;
+    heap->rover = 0;
     return true; // returns true if the initialization is successful and false otherwise 
 }
 
-// This function allocates a memory block of the requested size 
-void *mymalloc(size_t requested_size) {
+// This function initializes the default heap behind the mymalloc family 
+bool myinit(void *heap_start, size_t heap_size) {
+    return initHeap(&defaultHeap, heap_start, heap_size);
+}
+
+// This function sets up a heap whose state sits at the front of its own segment 
+heap_t *heap_create(void *segment_start, size_t segment_size) {
+    size_t stateSize = roundup(sizeof(heap_t));
+    if (segment_start == NULL || segment_size < stateSize) {
+        return NULL;
+    }
+    heap_t *heap = segment_start;
+    if (!initHeap(heap, (unsigned char *)segment_start + stateSize, segment_size - stateSize)) {
+        return NULL;
+    }
+    return heap;
+}
+
+// This function finds room for a request on a small-object page or in the heap 
+static void *allocateRequest(heap_t *heap, size_t requested_size) {
     if (requested_size == 0) {
         return NULL;
     }
     
     // Rounds up for alignment and check size limits 
     requested_size = roundup(requested_size);
-    if (requested_size > MAX_REQUEST_SIZE || (requested_size + sizeUsed) > heapSize) {
+    if (requested_size > MAX_REQUEST_SIZE || (requested_size + heap->sizeUsed) > heap->heapSize) {
         return NULL;
     }
-    
-    size_t *header;
-    size_t payload;
-    size_t state;
+
+    // Small requests get a headerless slot on a page of their size class 
+    if (requested_size <= BIBOP_MAX_OBJECT) {
+        return bibopAlloc(heap, requested_size);
+    }
     
     // Traverses heap and find large enough block
-    for (size_t i = 0; i < heapSize; i += 8) {
-        unsigned char *newIndex = (unsigned char *)heapStart + i;
-        header = (size_t *)newIndex;
-        payload = *header;
-        state = *header & 1; // extracts the allocation bit 
-        
-        if (state == 0) {
-            // Checks if the payload is large enough for the requested size
-            if (requested_size <= MAX_REQUEST_SIZE && requested_size <= payload) {
-                size_t used;
-                used = 8 + payload;
-
-                // Checks block and split if significantly larger than needed 
-                if ((payload - requested_size) >= 16) {
-                    splitFunc(&used, header, payload, requested_size);
-                }
+    size_t *header = findFit(heap, requested_size);
+    if (header == NULL) {
+        return NULL; // returns NULL if allocation failed 
+    }
+    return placeBlock(heap, header, requested_size); // returns pointer to the allocated payload 
+}
+
+// This function allocates a memory block of the requested size 
+void *heap_malloc(heap_t *heap, size_t requested_size) {
+    void *ptr = allocateRequest(heap, requested_size);
+    if (ptr != NULL) {
+        heap->counters.mallocs++;
+    }
+    return ptr;
+}
+
+// This function allocates a block whose payload address is a multiple of alignment (a power of two) 
+void *heap_aligned_alloc(heap_t *heap, size_t alignment, size_t requested_size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
 
-                // Marks block as allocated 
-                *header ^= 1;
-                sizeUsed += used; 
+    // Every block is 8-byte aligned already 
+    if (alignment <= ALIGNMENT) {
+        return heap_malloc(heap, requested_size);
+    }
+    if (requested_size == 0) {
+        return NULL;
+    }
 
-                // Returns pointer to payload (skip header) 
-                unsigned char *payload_address = (unsigned char *)header + 8;
-                void *ptr = payload_address;
-                return ptr; // returns pointer to the allocated payload 
+    requested_size = roundup(requested_size);
+    if (requested_size > MAX_REQUEST_SIZE || (requested_size + heap->sizeUsed) > heap->heapSize) {
+        return NULL;
+    }
+
+    // Small objects sit at arbitrary 8-byte offsets on their page, so even small requests get a block 
+    void *ptr = allocateAligned(heap, requested_size, alignment, 0);
+    if (ptr != NULL) {
+        heap->counters.mallocs++;
+    }
+    return ptr;
+}
+
+// This function allocates a zeroed array of nmemb elements of the given size 
+void *heap_calloc(heap_t *heap, size_t nmemb, size_t size) {
+    // Rejects requests whose total size overflows 
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    size_t total = nmemb * size;
+
+    // The mark is read before the allocation raises it past the new block 
+    unsigned char *mark = heap->zeroMark;
+    unsigned char *ptr = heap_malloc(heap, total);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    // Small objects come from pages whose free lists run through them, so they are always cleared 
+    if (total <= BIBOP_MAX_OBJECT) {
+        memset(ptr, 0, total);
+        return ptr;
+    }
+
+    // Only the part below the old high-water mark can hold old data, the rest is still zero from mmap 
+    if (ptr < mark) {
+        size_t dirty = mark - ptr;
+        memset(ptr, 0, dirty < total ? dirty : total);
+    }
+    return ptr;
+}
+
+// This function allocates n blocks of the same size, carving them all out of one free block when it can 
+size_t heap_malloc_batch(heap_t *heap, size_t size, size_t n, void *out[]) {
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+    size_t requested_size = roundup(size);
+    size_t done = 0;
+
+    // Small objects come from their pages, where each allocation is already a list pop 
+    if (requested_size <= BIBOP_MAX_OBJECT) {
+        for (; done < n; done++) {
+            out[done] = bibopAlloc(heap, requested_size);
+            if (out[done] == NULL) {
+                break;
             }
         }
-        
-        // Allocated block - clear allocation bit (to get the size)
-        if (state == 1) {
-            payload ^= 1;
-        }   
-        
-        // Moves to the next block 
-        i += payload;
+        heap->counters.mallocs += done;
+        return done;
+    }
+    if (requested_size > MAX_REQUEST_SIZE) {
+        return 0;
+    }
+
+    // Lays the blocks out back to back as one allocation, then writes a header for each of them 
+    size_t stride = 8 + requested_size;
+    size_t *header = NULL;
+    if (n <= (heap->heapSize - heap->sizeUsed) / stride) {
+        header = findFit(heap, n * stride - 8);
+    }
+    if (header != NULL) {
+        unsigned char *current = placeBlock(heap, header, n * stride - 8);
+        current -= 8;
+
+        // The last block keeps any slack that was too small to split off 
+        size_t last = (*header ^ 1) - (n - 1) * stride;
+        for (size_t i = 0; i < n; i++) {
+            size_t payload = (i == n - 1) ? last : requested_size;
+            *(size_t *)current = payload ^ 1;
+            out[i] = current + 8;
+            current += stride;
+        }
+        heap->counters.mallocs += n;
+        return n;
+    }
+
+    // Falls back to one block at a time when no single free block can hold them all 
+    for (; done < n; done++) {
+        out[done] = heap_malloc(heap, size);
+        if (out[done] == NULL) {
+            break;
+        }
+    }
+    return done;
+}
+
+// This function orders two pointers by address for qsort 
+static int compareAddresses(const void *a, const void *b) {
+    uintptr_t first = (uintptr_t)*(void *const *)a;
+    uintptr_t second = (uintptr_t)*(void *const *)b;
+    return (first > second) - (first < second);
+}
+
+// This function frees a batch of blocks, merging each run of neighbours in the batch before freeing it 
+void heap_free_batch(heap_t *heap, void *ptrs[], size_t n) {
+    /* - Sorting by address puts blocks that sit next to each other side by side
+       - Each run of neighbours is turned into one allocated block first, so the
+         run is freed (and merged with the free blocks after it) only once 
+    */ 
+    qsort(ptrs, n, sizeof(void *), compareAddresses);
+
+    size_t i = 0;
+    while (i < n) {
+        unsigned char *ptr = ptrs[i++];
+        if (ptr == NULL) {
+            continue;
+        }
+        heap->counters.frees++;
+        size_t index = *pageEntry(heap, ptr);
+        if (index != 0) {
+            bibopFree(heap, ptr, index - 1);
+            continue;
+        }
+
+        // Absorbs every following block of the batch that starts right where the run ends 
+        size_t *header = (size_t *)(ptr - 8);
+        size_t payload = *header ^ 1;
+        while (i < n && (unsigned char *)ptrs[i] == ptr + payload + 8 && *pageEntry(heap, ptrs[i]) == 0) {
+            payload += 8 + (*(size_t *)((unsigned char *)ptrs[i] - 8) ^ 1);
+            i++;
+            heap->counters.frees++;
+            heap->counters.coalesces++;
+        }
+        *header = payload ^ 1;
+        freeBlock(heap, ptr);
     }
-    return NULL; // returns NULL if allocation failed 
 }
 
 // This function frees the previously allocated memory blocks by clearing allocation bit in header 
-void myfree(void *ptr) {
+void heap_free(heap_t *heap, void *ptr) {
     if (ptr != NULL) { 
-        // Finds header by going back 8 bytes from payload 
-        unsigned char *h = (unsigned char *)ptr - 8;
-        size_t *header = (size_t *)h; 
+        heap->counters.frees++;
 
-        // Clears allocation bit to mark it as free 
-        *header ^= 1; 
+        // Small objects have no header, their page map entry says where they belong 
+        size_t index = *pageEntry(heap, ptr);
+        if (index != 0) {
+            bibopFree(heap, ptr, index - 1);
+            return;
+        }
 
-        // Updates the global usage counter 
-        sizeUsed -= (*header + 8);
+        freeBlock(heap, ptr);
     }
 }
 
+// This function frees a block whose size the caller already knows 
+void heap_free_sized(heap_t *heap, void *ptr, size_t size) {
+    /* - The page map alone routes the free, so a small object is freed without
+         reading anything but its page's header 
+       - Debug builds check that the size fits the block it is freeing 
+    */ 
+    if (ptr != NULL) {
+        size_t index = *pageEntry(heap, ptr);
+#ifndef NDEBUG
+        size_t capacity = (index != 0) ? bibopSize(index - 1) : (*(size_t *)((unsigned char *)ptr - 8) ^ 1);
+        assert(size <= capacity); // size doesn't match the block 
+#endif
+        heap->counters.frees++;
+        if (index != 0) {
+            bibopFree(heap, ptr, index - 1);
+        } else {
+            freeBlock(heap, ptr);
+        }
+    }
+}
+
+// This function returns the payload size of a block, which can be more than was asked for 
+size_t heap_usable_size(heap_t *heap, void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    // Small objects have no header, their class gives their size 
+    size_t index = *pageEntry(heap, ptr);
+    if (index != 0) {
+        return bibopSize(index - 1);
+    }
+    return *(size_t *)((unsigned char *)ptr - 8) ^ 1;
+}
+
 // This function reallocates the memory block to the new size 
-void *myrealloc(void *old_ptr, size_t new_size) {
+void *heap_realloc(heap_t *heap, void *old_ptr, size_t new_size) {
     /* Uses a simple approach 
         - Find new block 
         - Copy data 
@@ -148,78 +881,78 @@ void *myrealloc(void *old_ptr, size_t new_size) {
 
     // Handles free case 
     if (new_size == 0 && old_ptr != NULL) {
-        myfree(old_ptr);
+        heap_free(heap, old_ptr);
         return old_ptr;
     }
     
     // Checks the size limits 
     size_t requested_size = roundup(new_size);
-    if (requested_size > MAX_REQUEST_SIZE || (requested_size + sizeUsed) > heapSize) {
+    if (requested_size > MAX_REQUEST_SIZE || (requested_size + heap->sizeUsed) > heap->heapSize) {
         return NULL;
     }
 
     // Handles malloc case 
     if (old_ptr == NULL) {
-        return mymalloc(new_size);
+        return heap_malloc(heap, new_size);
     }
-    
-    size_t *header;
-    size_t payload;
-    size_t state;
-    
-    // Traverses heap to find large enough block using first-fit strategy 
-    for (size_t i = 0; i < heapSize; i += 8) {
-        unsigned char *newindex = (unsigned char *)heapStart + i;
-        header = (size_t *)newindex;
-        payload = *header;
-        state = *header & 1;
-        
-        if (state == 0) { // free block 
-            // Checks if the payload is large enough for the requested size
-            if (requested_size <= MAX_REQUEST_SIZE && requested_size <= payload) {
-                size_t used = 8 + payload;
-
-                // Gets old block info 
-                unsigned char *old_header = (unsigned char *)old_ptr - 8;
-                size_t *old_h = (size_t *)old_header;
-                
-                // If current block is large enough, return without reallocating 
-                if ((*old_h ^ 1) > new_size) {
-                    return old_ptr; 
-                } 
-
-                // Frees the old block 
-                *old_h ^= 1;
-                sizeUsed -= (*old_h + 8);
-                
-                // Splits the new block if necessary 
-                if ((payload - requested_size) >= 16) {
-                    splitFunc(&used, header, payload, requested_size);
-                }
-                
-                // Allocates the new block 
-                *header ^= 1;
-                sizeUsed += used; 
-
-                // Copies the data from the old to the new location 
-                unsigned char *payload_address = (unsigned char *)header + 8;
-                void *ptr = payload_address;
-                memmove(ptr, old_ptr, *old_h); // Uses size of old block for the copy 
-                return ptr;
-            }
-        }
 
-        if (state == 1) { // Skips allocated blocks 
-            payload ^= 1;
+    // Small objects stay put while the new size fits their class, and move otherwise 
+    size_t index = *pageEntry(heap, old_ptr);
+    if (index != 0) {
+        size_t objSize = bibopSize(index - 1);
+        if (requested_size <= objSize) {
+            heap->counters.reallocs++;
+            heap->counters.reallocs_in_place++;
+            return old_ptr;
         }
-        
-        i += payload;
+        void *ptr = allocateRequest(heap, new_size);
+        if (ptr == NULL) {
+            return NULL;
+        }
+        memcpy(ptr, old_ptr, objSize);
+        bibopFree(heap, old_ptr, index - 1);
+        heap->counters.reallocs++;
+        heap->counters.reallocs_moved++;
+        return ptr;
     }
-    return NULL;
+
+    // Gets old block info 
+    unsigned char *old_header = (unsigned char *)old_ptr - 8;
+    size_t *old_h = (size_t *)old_header;
+
+    // If current block is large enough, shrink it in place and free the surplus 
+    if (requested_size <= (*old_h ^ 1)) {
+        releaseTail(heap, old_h, requested_size);
+        heap->counters.reallocs++;
+        heap->counters.reallocs_in_place++;
+        return old_ptr; 
+    } 
+    
+    // Traverses heap to find large enough block 
+    size_t *header = findFit(heap, requested_size);
+    if (header == NULL) {
+        return NULL;
+    }
+    void *ptr = placeBlock(heap, header, requested_size);
+
+    // Copies the data from the old to the new location, then frees the old block 
+    memmove(ptr, old_ptr, *old_h ^ 1); // Uses size of old block for the copy 
+    freeBlock(heap, old_ptr);
+    heap->counters.reallocs++;
+    heap->counters.reallocs_moved++;
+    return ptr;
+}
+
+// This function reports the running counters, with the largest free block read off the top of its tree 
+void heap_stats(heap_t *heap, struct heap_stats *stats) {
+    *stats = heap->counters;
+    stats->largest_free = treeEntry(heap, heap->treeLevels - 1, 0);
+    stats->bytes_in_use = heap->sizeUsed;
+    stats->bytes_free = heap->heapSize - heap->sizeUsed;
 }
 
 // Validates the heap consistency by checking the internal data structures 
-bool validate_heap() {
+bool heap_validate(heap_t *heap) {
     /* Verifies that: 
         - Blocks account for the total heap size 
         - Global usage counter matches the actual allocated space 
@@ -227,20 +960,31 @@ bool validate_heap() {
      */
     
     // Basic check 
-    if (sizeUsed > heapSize) {
+    if (heap->sizeUsed > heap->heapSize) {
         return false;
     } 
 
     size_t *h;
     size_t used = 0; // Running total of the allocated space 
     size_t freed = 0; // Running total of the free space 
+    bool roverFound = false; // The rover has to land on a block header 
+    size_t freeBlocks = 0; // Number of free blocks, which must match the bits set in freeMap 
+    size_t largest = 0; // Largest free payload, which must match the top of the tree 
 
     // Traverses through the heap and tallies the freed and used space
-    for (size_t i = 0; i < heapSize; i += 8) {
-        unsigned char *current_index = (unsigned char *)heapStart + i;
+    for (size_t i = 0; i < heap->heapSize; i += 8) {
+        unsigned char *current_index = (unsigned char *)heap->heapStart + i;
         h = (size_t *)current_index;
         size_t payload = *h ^ 1; // removes the allocation bit to get the size 
         size_t state = *h & 1; // Extracts the allocation bit 
+        if (i == heap->rover) {
+            roverFound = true;
+        }
+        
+        if (isMarkedFree(heap, h) != (state == 0)) { // Bitmap disagrees with the header 
+            breakpoint();
+            return false;
+        }
         
         size_t current_used;
         size_t current_free;
@@ -248,6 +992,10 @@ bool validate_heap() {
             payload = *h; 
             current_free = 8 + payload;
             freed += current_free;
+            freeBlocks++;
+            if (payload > largest) {
+                largest = payload;
+            }
         } else if (state == 1) { // allocated block 
             current_used = 8 + payload;
             used += current_used;
@@ -257,27 +1005,101 @@ bool validate_heap() {
     }
 
     // Check the housekeeping information about the parameters
-    if ((freed + used) != heapSize) {
+    if ((freed + used) != heap->heapSize) {
         breakpoint(); // breakpoint for investigation 
         return false;
     } 
 
-    if (sizeUsed != used) { // Global counter mismatch 
+    if (heap->sizeUsed != used) { // Global counter mismatch 
         breakpoint(); 
         return false;
     } 
 
+    if (!roverFound) { // Rover points into the middle of a block 
+        breakpoint();
+        return false;
+    }
+
+    // A bit set anywhere other than on a free block header would be a stray 
+    size_t bitsSet = 0;
+    for (size_t w = 0; w < heap->mapClean; w++) {
+        bitsSet += __builtin_popcountll(heap->freeMap[w]);
+    }
+    if (bitsSet != freeBlocks || heap->counters.free_blocks != freeBlocks) {
+        breakpoint();
+        return false;
+    }
+
+    // Each entry of the tree must be the largest of the free blocks or entries under it 
+    for (size_t level = 0; level < heap->treeLevels; level++) {
+        size_t entries = (level == 0) ? heap->mapClean : (heap->treeClean[level - 1] + 63) >> 6;
+        if (heap->treeClean[level] > entries) { // Initialized past anything that can be free 
+            breakpoint();
+            return false;
+        }
+        for (size_t j = 0; j < entries; j++) {
+            size_t expected = 0;
+            if (level == 0) {
+                for (uint64_t bits = heap->freeMap[j]; bits != 0; bits &= bits - 1) {
+                    size_t *free = (size_t *)heap->heapStart + (j << 6) + __builtin_ctzll(bits);
+                    if (*free > expected) {
+                        expected = *free;
+                    }
+                }
+            } else {
+                for (size_t k = j << 6; k < (j << 6) + 64; k++) {
+                    if (treeEntry(heap, level - 1, k) > expected) {
+                        expected = treeEntry(heap, level - 1, k);
+                    }
+                }
+            }
+            if (treeEntry(heap, level, j) != expected) {
+                breakpoint();
+                return false;
+            }
+        }
+    }
+    if (treeEntry(heap, heap->treeLevels - 1, 0) != largest) {
+        breakpoint();
+        return false;
+    }
+
+    // Every small-object page with room must be mapped to its class and have an accurate free count 
+    for (size_t index = 0; index < NUM_BIBOP_CLASSES; index++) {
+        for (bibop_page *page = heap->partialPages[index]; page != NULL; page = page->next) {
+            if (*pageEntry(heap, page) != index + 1 || (page->h & 1) == 0 || page->numFree == 0) {
+                breakpoint();
+                return false;
+            }
+
+            size_t count = 0;
+            for (unsigned char *obj = page->freeObjects; obj != NULL; obj = *(void **)obj) {
+                size_t offset = obj - ((unsigned char *)page + sizeof(bibop_page));
+                if (offset >= bibopCapacity(index) * bibopSize(index) || offset % bibopSize(index) != 0 ||
+                    ++count > page->numFree) {
+                    breakpoint();
+                    return false;
+                }
+            }
+            if (count != page->numFree) {
+                breakpoint();
+                return false;
+            }
+        }
+    }
+
     return true; // returns true if heap is valid and false whenever corruption is detected 
 }
 
 // This file dumps the contents of the heap by printing them out
 void dump_heap() { 
+    heap_t *heap = &defaultHeap;
     // Displays heap boundaries. usage statistics, and block information 
-    printf("Heap starts at address %p and ends at %p. %lu bytes currently used.\n", heapStart, (unsigned char *)heapStart + heapSize, sizeUsed);
+    printf("Heap starts at address %p and ends at %p. %lu bytes currently used.\n", heap->heapStart, (unsigned char *)heap->heapStart + heap->heapSize, heap->sizeUsed);
     
     size_t index = 0;
-    while (index < heapSize) {
-        unsigned char *curr = (unsigned char *)heapStart + index;
+    while (index < heap->heapSize) {
+        unsigned char *curr = (unsigned char *)heap->heapStart + index;
         size_t *cur = (size_t *)curr; 
 
         printf("The payload is: %zu", *cur);
@@ -285,4 +1107,53 @@ void dump_heap() {
     }
         
         
-}
\ No newline at end of file
+}
+
+/* 
+  DEFAULT HEAP 
+  The mymalloc family works on the heap set up by myinit. 
+ */ 
+
+void *mymalloc(size_t requested_size) {
+    return heap_malloc(&defaultHeap, requested_size);
+}
+
+void *myaligned_alloc(size_t alignment, size_t requested_size) {
+    return heap_aligned_alloc(&defaultHeap, alignment, requested_size);
+}
+
+void *mycalloc(size_t nmemb, size_t size) {
+    return heap_calloc(&defaultHeap, nmemb, size);
+}
+
+size_t mymalloc_batch(size_t size, size_t n, void *out[]) {
+    return heap_malloc_batch(&defaultHeap, size, n, out);
+}
+
+void *myrealloc(void *old_ptr, size_t new_size) {
+    return heap_realloc(&defaultHeap, old_ptr, new_size);
+}
+
+size_t myusable_size(void *ptr) {
+    return heap_usable_size(&defaultHeap, ptr);
+}
+
+void myfree(void *ptr) {
+    heap_free(&defaultHeap, ptr);
+}
+
+void myfree_sized(void *ptr, size_t size) {
+    heap_free_sized(&defaultHeap, ptr, size);
+}
+
+void myfree_batch(void *ptrs[], size_t n) {
+    heap_free_batch(&defaultHeap, ptrs, n);
+}
+
+void mystats(struct heap_stats *stats) {
+    heap_stats(&defaultHeap, stats);
+}
+
+bool validate_heap() {
+    return heap_validate(&defaultHeap);
+}
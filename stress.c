@@ -0,0 +1,241 @@
+/*
+ * File: stress.c
+ * --------------
+ * Hammers a thread-safe allocator from many threads at once, with most
+ * blocks freed by a different thread from the one that allocated them.
+ * The threads share a table of mailboxes. Each step allocates a block in
+ * one of several ways, fills it with a pattern that records its size, and
+ * swaps it into a random mailbox. The block that comes out was usually
+ * made by another thread. It is checked against its pattern and its
+ * usable size, sometimes resized, and then freed with myfree,
+ * myfree_sized or in a batch. At the end every block is freed, and the
+ * heap must validate and count as many frees as allocations.
+ *
+ * When you compile using `make stress_<allocator>`, it will create this
+ * program for a thread-safe build of that allocator (see THREADED in the
+ * Makefile). `make check_threads` builds and runs all of them. Usage:
+ *     ./stress_hoard [-t threads] [-n steps per thread]
+ * It prints "ok" and exits with 0 if nothing went wrong.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "segment.h"
+
+const long HEAP_SIZE = 1L << 32;
+
+#define NUM_MAILBOXES 4096
+#define BATCH_SIZE 16
+
+static int nthreads = 8;
+static long nsteps = 200000;
+
+static void *mailboxes[NUM_MAILBOXES];
+static int failed;
+
+
+/* Function: fail
+ * --------------
+ * Reports a broken block and makes the run fail.
+ */
+static void fail(const char *what, void *ptr, size_t size) {
+    printf("%s: block %p of %zu bytes\n", what, ptr, size);
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+/* Function: pick_size
+ * -------------------
+ * Picks a block size: mostly small ones, some medium and a few large.
+ */
+static size_t pick_size(unsigned int *seed) {
+    int pick = rand_r(seed) % 100;
+    if (pick < 80) {
+        return 8 + rand_r(seed) % 249;
+    } else if (pick < 97) {
+        return 257 + rand_r(seed) % 3840;
+    }
+    return 4097 + rand_r(seed) % 61440;
+}
+
+/* Function: fill
+ * --------------
+ * Writes a block's size into its first word and a byte derived from the
+ * size into the rest.
+ */
+static void fill(void *ptr, size_t size) {
+    *(size_t *)ptr = size;
+    memset((char *)ptr + sizeof(size_t), (int)(size & 0xff), size - sizeof(size_t));
+}
+
+/* Function: check
+ * ---------------
+ * Checks a block still holds the pattern fill wrote and returns its size,
+ * or 0 if it doesn't.
+ */
+static size_t check(void *ptr) {
+    size_t size = *(size_t *)ptr;
+    if (size < sizeof(size_t) || size > (1 << 20)) {
+        fail("bad size word", ptr, size);
+        return 0;
+    }
+    unsigned char *bytes = ptr;
+    for (size_t i = sizeof(size_t); i < size; i++) {
+        if (bytes[i] != (size & 0xff)) {
+            fail("pattern overwritten", ptr, size);
+            return 0;
+        }
+    }
+    if (myusable_size(ptr) < size) {
+        fail("usable size too small", ptr, size);
+        return 0;
+    }
+    return size;
+}
+
+/* Function: allocate
+ * ------------------
+ * Allocates and fills a block with mymalloc, mycalloc or myaligned_alloc.
+ */
+static void *allocate(unsigned int *seed) {
+    size_t size = pick_size(seed);
+    void *ptr;
+    int how = rand_r(seed) % 10;
+    if (how == 0) {
+        ptr = mycalloc(1, size);
+        for (size_t i = 0; ptr != NULL && i < size; i++) {
+            if (((unsigned char *)ptr)[i] != 0) {
+                fail("calloc block not zeroed", ptr, size);
+                break;
+            }
+        }
+    } else if (how == 1) {
+        size_t alignment = (size_t)16 << (rand_r(seed) % 8);
+        ptr = myaligned_alloc(alignment, size);
+        if (ptr != NULL && (uintptr_t)ptr % alignment != 0) {
+            fail("aligned block misaligned", ptr, size);
+        }
+    } else {
+        ptr = mymalloc(size);
+    }
+    if (ptr == NULL) {
+        fail("allocation failed", NULL, size);
+        return NULL;
+    }
+    fill(ptr, size);
+    return ptr;
+}
+
+/* Function: worker
+ * ----------------
+ * Runs this thread's steps, swapping blocks through the mailboxes.
+ */
+static void *worker(void *arg) {
+    unsigned int seed = (unsigned int)(intptr_t)arg + 1;
+    void *batch[BATCH_SIZE];
+    size_t nbatch = 0;
+
+    for (long step = 0; step < nsteps && !__atomic_load_n(&failed, __ATOMIC_RELAXED); step++) {
+        void *ptr = allocate(&seed);
+        if (ptr == NULL) {
+            break;
+        }
+        void *old = __atomic_exchange_n(&mailboxes[rand_r(&seed) % NUM_MAILBOXES], ptr, __ATOMIC_ACQ_REL);
+        if (old == NULL) {
+            continue;
+        }
+        size_t size = check(old);
+        if (size == 0) {
+            break;
+        }
+
+        int how = rand_r(&seed) % 8;
+        if (how == 0) {
+            // Resizes the block, which keeps the prefix that still fits
+            size_t new_size = pick_size(&seed);
+            void *moved = myrealloc(old, new_size);
+            if (moved == NULL) {
+                fail("realloc failed", old, new_size);
+                break;
+            }
+            size_t kept = size < new_size ? size : new_size;
+            for (size_t i = sizeof(size_t); i < kept; i++) {
+                if (((unsigned char *)moved)[i] != (size & 0xff)) {
+                    fail("realloc lost data", moved, new_size);
+                    break;
+                }
+            }
+            fill(moved, new_size);
+            myfree(moved);
+        } else if (how == 1) {
+            myfree_sized(old, size);
+        } else if (how == 2) {
+            batch[nbatch++] = old;
+            if (nbatch == BATCH_SIZE) {
+                myfree_batch(batch, nbatch);
+                nbatch = 0;
+            }
+        } else {
+            myfree(old);
+        }
+    }
+    myfree_batch(batch, nbatch);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "t:n:")) != EOF) {
+        switch (c) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'n': nsteps = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-t threads] [-n steps per thread]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (nthreads < 1) {
+        fprintf(stderr, "threads must be positive\n");
+        return 1;
+    }
+
+    init_heap_segment(HEAP_SIZE);
+    if (!myinit(heap_segment_start(), heap_segment_size())) {
+        printf("myinit() returned false\n");
+        return 1;
+    }
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    for (int i = 0; i < NUM_MAILBOXES && !failed; i++) {
+        if (mailboxes[i] != NULL && check(mailboxes[i]) != 0) {
+            myfree(mailboxes[i]);
+        }
+    }
+    if (failed) {
+        return 1;
+    }
+
+    struct heap_stats stats;
+    mystats(&stats);
+    if (!validate_heap()) {
+        printf("validate_heap() returned false\n");
+        return 1;
+    }
+    if (stats.mallocs != stats.frees) {
+        printf("%zu mallocs but %zu frees\n", stats.mallocs, stats.frees);
+        return 1;
+    }
+    printf("ok: %d threads, %ld steps each, %zu mallocs\n", nthreads, nsteps, stats.mallocs);
+    return 0;
+}
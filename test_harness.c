@@ -5,9 +5,9 @@
  * allocator requests. Runs the allocator on a script and validates
  * results for correctness.
  *
- * When you compile using `make`, it will create 3 different
- * compiled versions of this program, one using each type of
- * heap allocator.
+ * When you compile using `make`, it will create a different
+ * compiled version of this program for each type of heap
+ * allocator listed in ALLOCATORS in the Makefile.
  *
  * Written by jzelenski, updated by Nick Troccoli Winter 18-19
  */
@@ -31,12 +31,16 @@
 enum request_type {
     ALLOC = 1,
     FREE,
-    REALLOC
+    REALLOC,
+    ALIGNED_ALLOC,
+    CALLOC
 };
 typedef struct {
     enum request_type op;   // type of request
     int id;                 // id for free() to use later
     size_t size;            // num bytes for alloc/realloc request
+    size_t alignment;       // alignment for aligned alloc request
+    size_t nmemb;           // number of elements for calloc request
     int lineno;             // which line in file
 } request_t;
 
@@ -181,7 +185,8 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success) {
         int id = script->ops[req].id;
         size_t requested_size = script->ops[req].size;
 
-        if (script->ops[req].op == ALLOC) {
+        if (script->ops[req].op == ALLOC || script->ops[req].op == ALIGNED_ALLOC ||
+            script->ops[req].op == CALLOC) {
             bool fail = false;
             void *p = eval_malloc(req, requested_size, script, &fail);
             if (fail) {
@@ -244,7 +249,8 @@ static size_t eval_correctness(script_t *script, bool quiet, bool *success) {
 
 /* Function: eval_malloc
  * ---------------------
- * Performs a test of a call to mymalloc of the given size.  The req number
+ * Performs a test of a call to mymalloc of the given size, or to
+ * myaligned_alloc or mycalloc for those requests.  The req number
  * specifies the operation's index within the script.  This function verifies
  * the entire malloc'ed block and fills in the payload with a low-order byte
  * of the request id.  If the request fails, the boolean pointed to by
@@ -256,15 +262,44 @@ static void *eval_malloc(int req, size_t requested_size, script_t *script,
     bool *failptr) {
 
     int id = script->ops[req].id;
+    size_t alignment = script->ops[req].alignment;
+    size_t nmemb = script->ops[req].nmemb;
 
     void *p;
-    if ((p = mymalloc(requested_size)) == NULL && requested_size != 0) {
+    if (script->ops[req].op == ALIGNED_ALLOC) {
+        p = myaligned_alloc(alignment, requested_size);
+    } else if (script->ops[req].op == CALLOC) {
+        p = mycalloc(nmemb, nmemb == 0 ? 0 : requested_size / nmemb);
+    } else {
+        p = mymalloc(requested_size);
+    }
+    if (p == NULL && requested_size != 0) {
         allocator_error(script, script->ops[req].lineno, 
             "heap exhausted, malloc returned NULL");
         *failptr = true;
         return NULL;
     }
 
+    // aligned requests must honor the requested alignment
+    if (alignment != 0 && ((uintptr_t)p) % alignment != 0) {
+        allocator_error(script, script->ops[req].lineno,
+            "New block (%p) not aligned to %zu bytes", p, alignment);
+        *failptr = true;
+        return NULL;
+    }
+
+    // calloc'ed blocks must come back zeroed
+    if (script->ops[req].op == CALLOC) {
+        for (size_t i = 0; i < requested_size; i++) {
+            if (((unsigned char *)p)[i] != 0) {
+                allocator_error(script, script->ops[req].lineno,
+                    "New block (%p) from calloc not zeroed at offset %zu", p, i);
+                *failptr = true;
+                return NULL;
+            }
+        }
+    }
+
     /* Test new block for correctness: must be properly aligned
      * and must not overlap any currently allocated block.
      */
@@ -520,19 +555,31 @@ static bool read_line(char buffer[], size_t buffer_size, FILE *fp,
  * ---------------------------
  * This function parses the provided line from the script and returns info
  * about it as a request_t object filled in with the type of the request,
- * the size, the ID, and the line number.  If the line is malformed, this
- * function throws an error.
+ * the size, the ID, and the line number.  An aligned allocation is written
+ * "m id size alignment", with alignment a power of two, and a calloc is
+ * written "c id nmemb size".  If the line is malformed, this function throws
+ * an error.
  */
 static request_t parse_script_line(char *buffer, int i, int lineno, 
     char *script_name) {
 
-    request_t request = { .lineno = lineno, .op = 0, .size = 0};
+    request_t request = { .lineno = lineno, .op = 0, .size = 0, .alignment = 0, .nmemb = 0};
 
     char request_char;
-    int nscanned = sscanf(buffer, " %c %d %zu", &request_char, 
-        &request.id, &request.size);
+    int nscanned = sscanf(buffer, " %c %d %zu %zu", &request_char, 
+        &request.id, &request.size, &request.alignment);
     if (request_char == 'a' && nscanned == 3) {
         request.op = ALLOC;
+    } else if (request_char == 'm' && nscanned == 4 && request.alignment != 0 &&
+               (request.alignment & (request.alignment - 1)) == 0) {
+        request.op = ALIGNED_ALLOC;
+    } else if (request_char == 'c' && nscanned == 4 && (request.alignment == 0 ||
+               request.size <= MAX_REQUEST_SIZE / request.alignment)) {
+        // the last two fields are the element count and size, not size and alignment
+        request.op = CALLOC;
+        request.nmemb = request.size;
+        request.size *= request.alignment;
+        request.alignment = 0;
     } else if (request_char == 'r' && nscanned == 3) {
         request.op = REALLOC;
     } else if (request_char == 'f' && nscanned == 2) {
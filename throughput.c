@@ -0,0 +1,144 @@
+/*
+ * File: throughput.c
+ * ------------------
+ * Measures how allocation throughput scales with the number of threads.
+ * For 1, 2, 4, ... up to the given number of threads, every thread runs
+ * the same number of steps on a working set of its own. Each step frees
+ * the block in a random slot of the set and puts a new one there, mostly
+ * small with the odd larger one. A share of the new blocks is swapped
+ * through a table shared by all threads, so those blocks get freed by a
+ * thread other than the one that allocated them. Each line reports the
+ * total operations per second and the speedup over one thread. A
+ * perfectly scalable allocator gets a speedup equal to the number of
+ * threads, up to the number of cores.
+ *
+ * When you compile using `make throughput_<allocator>`, it will create
+ * this program for a thread-safe build of that allocator (see THREADED in
+ * the Makefile). Usage:
+ *     ./throughput_hoard [-t max threads] [-n steps per thread] [-x % shared]
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "allocator.h"
+#include "segment.h"
+
+const long HEAP_SIZE = 1L << 32;
+
+#define WORKING_SET 1024
+#define NUM_SHARED 1024
+
+static int max_threads = 8;
+static long nsteps = 1000000;
+static int shared_percent = 10;
+
+static void *shared[NUM_SHARED];
+
+
+/* Function: now
+ * -------------
+ * Returns the time in seconds on a monotonic clock.
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Function: worker
+ * ----------------
+ * Runs this thread's steps and frees its working set at the end.
+ */
+static void *worker(void *arg) {
+    unsigned int seed = (unsigned int)(intptr_t)arg + 1;
+    void *slots[WORKING_SET] = {NULL};
+
+    for (long step = 0; step < nsteps; step++) {
+        int pick = rand_r(&seed);
+        size_t size = (pick % 64 == 0) ? 257 + pick % 4000 : 8 + pick % 249;
+        void *ptr = mymalloc(size);
+        if (ptr == NULL) {
+            printf("mymalloc(%zu) failed\n", size);
+            exit(1);
+        }
+        *(char *)ptr = 1;
+
+        // Some blocks trade places with one another thread left in the shared table
+        if (rand_r(&seed) % 100 < shared_percent) {
+            ptr = __atomic_exchange_n(&shared[rand_r(&seed) % NUM_SHARED], ptr, __ATOMIC_ACQ_REL);
+            if (ptr == NULL) {
+                continue;
+            }
+        }
+        size_t slot = rand_r(&seed) % WORKING_SET;
+        myfree(slots[slot]);
+        slots[slot] = ptr;
+    }
+    for (size_t i = 0; i < WORKING_SET; i++) {
+        myfree(slots[i]);
+    }
+    return NULL;
+}
+
+/* Function: run
+ * -------------
+ * Runs the given number of threads on a fresh heap and returns how many
+ * operations per second they managed together, counting each malloc and
+ * each free as one.
+ */
+static double run(int nthreads) {
+    if (!myinit(heap_segment_start(), heap_segment_size())) {
+        printf("myinit() returned false\n");
+        exit(1);
+    }
+    memset(shared, 0, sizeof(shared));
+
+    pthread_t threads[nthreads];
+    double start = now();
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    for (int i = 0; i < NUM_SHARED; i++) {
+        myfree(shared[i]);
+    }
+    return 2.0 * nsteps * nthreads / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "t:n:x:")) != EOF) {
+        switch (c) {
+            case 't': max_threads = atoi(optarg); break;
+            case 'n': nsteps = atol(optarg); break;
+            case 'x': shared_percent = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-t max threads] [-n steps per thread] [-x %% shared]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (max_threads < 1 || nsteps < 1) {
+        fprintf(stderr, "threads and steps must be positive\n");
+        return 1;
+    }
+
+    init_heap_segment(HEAP_SIZE);
+    double base = 0;
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        double rate = run(nthreads);
+        if (nthreads == 1) {
+            base = rate;
+        }
+        printf("%3d threads: %7.2f Mops/s, speedup %.2f\n", nthreads, rate / 1e6, rate / base);
+    }
+    return 0;
+}
@@ -0,0 +1,594 @@
+/* File: tlsf.c
+ * ------------
+ * A two-level segregated fit (TLSF) allocator. Free blocks are kept in an
+ * array of lists indexed by two levels of size class: the first level splits
+ * payload sizes by power of two, and the second level splits each
+ * power-of-two range into SL_COUNT equal slices. One bitmap for the first
+ * level and one per first-level class for the second level record which lists
+ * are non-empty, so finding a list that is guaranteed to fit a request takes
+ * a couple of find-first-set operations instead of a walk. mymalloc and
+ * myfree therefore run in O(1) worst case regardless of how many blocks
+ * are on the heap.
+ *
+ * Block format:
+ * - Header (8 bytes): payload size, ALLOC_BIT (bit 0) and PREV_FREE_BIT (bit 1),
+ *   which records whether the block to the left is free
+ * - Payload: user data (8-byte aligned). While the block is free, the first
+ *   two words hold the next/prev links of its free list and the last word
+ *   holds a footer copy of the size, so the block to its right can find
+ *   its header when coalescing.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "debug_break.h"
+
+// Status bits kept in the low bits of the header word
+#define ALLOC_BIT 1
+#define PREV_FREE_BIT 2
+#define SIZE_MASK (~(size_t)7)
+
+#define HEADER_SIZE 8
+
+// Smallest payload that can hold the two list links and the footer once freed
+#define MIN_PAYLOAD 24
+
+// Second level: each power-of-two range is divided into SL_COUNT lists
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+
+// Payloads below SMALL_BLOCK all share first-level class 0, one list per 8 bytes
+#define ALIGN_LOG2 3
+#define FL_SHIFT (SL_LOG2 + ALIGN_LOG2)
+#define SMALL_BLOCK ((size_t)1 << FL_SHIFT)
+
+// First level: enough classes for payloads up to 2^(FL_COUNT + FL_SHIFT - 1) bytes
+#define FL_COUNT 32
+#define MAX_BLOCK_SIZE (((size_t)1 << (FL_COUNT + FL_SHIFT - 1)) - 1)
+
+typedef struct free_block {
+    size_t h;                 // payload size with status bits
+    struct free_block *next;  // next free block in the same list
+    struct free_block *prev;  // previous free block in the same list
+} free_block_t;
+
+static void *segment_start;
+static size_t segment_size;
+static size_t nused;        // bytes in allocated blocks, headers included
+
+static unsigned int fl_bitmap;            // bit i set if any list in first-level class i is non-empty
+static unsigned int sl_bitmap[FL_COUNT];  // bit j of entry i set if blocks[i][j] is non-empty
+static free_block_t *blocks[FL_COUNT][SL_COUNT];
+
+
+/* Function: roundup
+ * -----------------
+ * This function rounds up the given number to the given multiple, which
+ * must be a power of 2, and returns the result.
+ */
+size_t roundup(size_t sz, size_t mult) {
+    return (sz + mult-1) & ~(mult-1);
+}
+
+/* Function: fls
+ * -------------
+ * Returns the index of the most significant set bit of x, which must be
+ * non-zero.
+ */
+static int fls(size_t x) {
+    return (int)(sizeof(size_t) * 8 - 1) - __builtin_clzl(x);
+}
+
+/* Function: mapping_insert
+ * ------------------------
+ * Computes the first- and second-level indexes of the list a free block
+ * with the given payload size belongs to.
+ */
+static void mapping_insert(size_t size, int *fl, int *sl) {
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = (int)(size >> ALIGN_LOG2);
+    } else {
+        int msb = fls(size);
+        *fl = msb - FL_SHIFT + 1;
+        *sl = (int)(size >> (msb - SL_LOG2)) - SL_COUNT;
+    }
+}
+
+/* Function: mapping_search
+ * ------------------------
+ * Computes the indexes of the first list whose blocks are all at least the
+ * given size. The size is rounded up to the next second-level boundary
+ * first, so any block found from these indexes fits without a search.
+ */
+static void mapping_search(size_t size, int *fl, int *sl) {
+    if (size >= SMALL_BLOCK) {
+        size += ((size_t)1 << (fls(size) - SL_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+/* Function: find_suitable
+ * -----------------------
+ * Starting at the list given by fl/sl, finds the first non-empty list using
+ * the bitmaps and returns its head, updating fl/sl to that list. Returns
+ * NULL if no list at or above the starting one has a free block.
+ */
+static free_block_t *find_suitable(int *fl, int *sl) {
+    if (*fl >= FL_COUNT) {
+        return NULL;
+    }
+
+    // Look for a non-empty list in the same first-level class first
+    unsigned int sl_map = sl_bitmap[*fl] & (~0U << *sl);
+    if (sl_map == 0) {
+        // Otherwise take the smallest non-empty list of a larger first-level class
+        unsigned int fl_map = (*fl + 1 < FL_COUNT) ? fl_bitmap & (~0U << (*fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        *fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[*fl];
+    }
+    *sl = __builtin_ctz(sl_map);
+    return blocks[*fl][*sl];
+}
+
+/* Function: insert_free
+ * ---------------------
+ * Pushes a free block onto the front of its list, writes its footer and
+ * marks the list as non-empty in the bitmaps.
+ */
+static void insert_free(free_block_t *block) {
+    int fl, sl;
+    size_t size = block->h & SIZE_MASK;
+    mapping_insert(size, &fl, &sl);
+
+    *(size_t *)((char *)block + HEADER_SIZE + size - sizeof(size_t)) = size;
+    block->prev = NULL;
+    block->next = blocks[fl][sl];
+    if (block->next != NULL) {
+        block->next->prev = block;
+    }
+    blocks[fl][sl] = block;
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+}
+
+/* Function: remove_free
+ * ---------------------
+ * Unlinks a free block from its list, clearing the bitmap bits if the list
+ * becomes empty.
+ */
+static void remove_free(free_block_t *block) {
+    int fl, sl;
+    mapping_insert(block->h & SIZE_MASK, &fl, &sl);
+
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        blocks[fl][sl] = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+
+    if (blocks[fl][sl] == NULL) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (sl_bitmap[fl] == 0) {
+            fl_bitmap &= ~(1U << fl);
+        }
+    }
+}
+
+/* Function: next_block
+ * --------------------
+ * Returns the header of the block physically after the given one, or NULL
+ * if the given block is the last one in the heap.
+ */
+static free_block_t *next_block(free_block_t *block) {
+    char *next = (char *)block + HEADER_SIZE + (block->h & SIZE_MASK);
+    return next < (char *)segment_start + segment_size ? (free_block_t *)next : NULL;
+}
+
+/* Function: adjust_size
+ * ---------------------
+ * Converts a request into the payload size of the block that will hold it.
+ */
+static size_t adjust_size(size_t requestedsz) {
+    size_t needed = roundup(requestedsz, ALIGNMENT);
+    return needed < MIN_PAYLOAD ? MIN_PAYLOAD : needed;
+}
+
+/* Function: trim_block
+ * --------------------
+ * Gives the part of an allocated block beyond needed back to the free
+ * lists. The leftover is merged into the right neighbour when that block is
+ * free, and otherwise only split off if it can stand as a free block.
+ */
+static void trim_block(free_block_t *block, size_t needed) {
+    size_t size = block->h & SIZE_MASK;
+    size_t surplus = size - needed;
+    free_block_t *next = next_block(block);
+    bool next_free = next != NULL && (next->h & ALLOC_BIT) == 0;
+
+    if (surplus == 0 || (!next_free && surplus < HEADER_SIZE + MIN_PAYLOAD)) {
+        return;
+    }
+
+    free_block_t *rest = (free_block_t *)((char *)block + HEADER_SIZE + needed);
+    size_t rest_size = surplus - HEADER_SIZE;
+    if (next_free) {
+        remove_free(next);
+        rest_size += HEADER_SIZE + next->h;
+    } else if (next != NULL) {
+        next->h |= PREV_FREE_BIT;
+    }
+    rest->h = rest_size;
+    insert_free(rest);
+
+    block->h = needed | (block->h & ~SIZE_MASK);
+    nused -= surplus;
+}
+
+/* Function: myinit
+ * ----------------
+ * This function initializes the bitmaps and lists and places a single free
+ * block spanning the whole segment (capped at the largest size the
+ * first-level index can represent).
+ */
+bool myinit(void *start, size_t size) {
+    if (start == NULL || size < HEADER_SIZE + MIN_PAYLOAD) {
+        return false;
+    }
+    if (size - HEADER_SIZE > MAX_BLOCK_SIZE) {
+        size = MAX_BLOCK_SIZE + HEADER_SIZE;
+    }
+
+    segment_start = start;
+    segment_size = size & SIZE_MASK;
+    nused = 0;
+    fl_bitmap = 0;
+    memset(sl_bitmap, 0, sizeof(sl_bitmap));
+    memset(blocks, 0, sizeof(blocks));
+
+    free_block_t *block = segment_start;
+    block->h = segment_size - HEADER_SIZE;
+    insert_free(block);
+    return true;
+}
+
+/* Function: mymalloc
+ * ------------------
+ * This function rounds the request up to the next second-level boundary,
+ * takes the head of the first non-empty list found through the bitmaps and
+ * splits off whatever the request does not need.
+ */
+void *mymalloc(size_t requestedsz) {
+    if (requestedsz == 0 || requestedsz > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    size_t needed = adjust_size(requestedsz);
+    int fl, sl;
+    mapping_search(needed, &fl, &sl);
+    free_block_t *block = find_suitable(&fl, &sl);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    remove_free(block);
+    block->h |= ALLOC_BIT;
+    nused += HEADER_SIZE + (block->h & SIZE_MASK);
+
+    free_block_t *next = next_block(block);
+    if (next != NULL) {
+        next->h &= ~PREV_FREE_BIT;
+    }
+    trim_block(block, needed);
+    return (char *)block + HEADER_SIZE;
+}
+
+/* Function: myaligned_alloc
+ * -------------------------
+ * This function takes a block with room to move the payload up to the next
+ * multiple of alignment, gives the skipped prefix back to the free lists as
+ * a block of its own and trims whatever the request does not need.
+ */
+void *myaligned_alloc(size_t alignment, size_t requestedsz) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return mymalloc(requestedsz);
+    }
+    if (requestedsz == 0 || requestedsz > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    // Room for the payload, the worst-case shift and a prefix that can stand as a free block
+    size_t needed = adjust_size(requestedsz);
+    int fl, sl;
+    mapping_search(needed + alignment + HEADER_SIZE + MIN_PAYLOAD, &fl, &sl);
+    free_block_t *block = find_suitable(&fl, &sl);
+    if (block == NULL) {
+        return NULL;
+    }
+    remove_free(block);
+
+    char *ptr = (char *)block + HEADER_SIZE;
+    char *aligned = (char *)roundup((uintptr_t)ptr, alignment);
+    while (aligned != ptr && (size_t)(aligned - ptr) < HEADER_SIZE + MIN_PAYLOAD) {
+        aligned += alignment;
+    }
+
+    size_t size = block->h & SIZE_MASK;
+    if (aligned != ptr) {
+        size_t prefix = aligned - ptr;
+        free_block_t *rest = (free_block_t *)(aligned - HEADER_SIZE);
+        rest->h = (size - prefix) | PREV_FREE_BIT;
+        block->h = (prefix - HEADER_SIZE) | (block->h & PREV_FREE_BIT);
+        insert_free(block);
+        block = rest;
+        size -= prefix;
+    }
+
+    block->h |= ALLOC_BIT;
+    nused += HEADER_SIZE + size;
+
+    free_block_t *next = next_block(block);
+    if (next != NULL) {
+        next->h &= ~PREV_FREE_BIT;
+    }
+    trim_block(block, needed);
+    return aligned;
+}
+
+/* Function: mycalloc
+ * ------------------
+ * This function checks the total size for overflow and zeroes the whole
+ * block, since freed blocks are reused anywhere in the heap.
+ */
+void *mycalloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *ptr = mymalloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+/* Function: mymalloc_batch
+ * ------------------------
+ * This function allocates the blocks one at a time with mymalloc, since a
+ * TLSF allocation is already a constant-time list pop.
+ */
+size_t mymalloc_batch(size_t size, size_t n, void *out[]) {
+    size_t done = 0;
+    for (; done < n; done++) {
+        out[done] = mymalloc(size);
+        if (out[done] == NULL) {
+            break;
+        }
+    }
+    return done;
+}
+
+/* Function: myusable_size
+ * ------------------------
+ * This function returns the payload size from the block header, which
+ * includes any leftover too small to split off.
+ */
+size_t myusable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    return ((free_block_t *)((char *)ptr - HEADER_SIZE))->h & SIZE_MASK;
+}
+
+/* Function: myfree
+ * ----------------
+ * This function coalesces the block with its free neighbours on either side
+ * and files the result in the list for its size.
+ */
+void myfree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    free_block_t *block = (free_block_t *)((char *)ptr - HEADER_SIZE);
+    size_t size = block->h & SIZE_MASK;
+    nused -= HEADER_SIZE + size;
+
+    free_block_t *next = next_block(block);
+    if (next != NULL && (next->h & ALLOC_BIT) == 0) {
+        remove_free(next);
+        size += HEADER_SIZE + next->h;
+    }
+
+    if (block->h & PREV_FREE_BIT) {
+        size_t prev_size = *(size_t *)((char *)block - sizeof(size_t));
+        block = (free_block_t *)((char *)block - HEADER_SIZE - prev_size);
+        remove_free(block);
+        size += HEADER_SIZE + prev_size;
+    }
+
+    block->h = size;
+    insert_free(block);
+
+    next = next_block(block);
+    if (next != NULL) {
+        next->h |= PREV_FREE_BIT;
+    }
+}
+
+/* Function: myfree_sized
+ * ----------------------
+ * Every block has a header that myfree reads anyway to coalesce, so the
+ * size adds nothing beyond a check in debug builds, after which this
+ * function just calls myfree.
+ */
+void myfree_sized(void *ptr, size_t size) {
+    assert(ptr == NULL || size <= myusable_size(ptr)); // size doesn't match the block
+    myfree(ptr);
+}
+
+/* Function: myfree_batch
+ * ----------------------
+ * This function frees the blocks one at a time with myfree, since
+ * each free already coalesces in constant time.
+ */
+void myfree_batch(void *ptrs[], size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        myfree(ptrs[i]);
+    }
+}
+
+/* Function: myrealloc
+ * -------------------
+ * This function shrinks in place, grows in place when the right neighbour
+ * is free and large enough, and otherwise moves the payload to a new block.
+ */
+void *myrealloc(void *oldptr, size_t newsz) {
+    if (oldptr == NULL) {
+        return mymalloc(newsz);
+    }
+    if (newsz == 0) {
+        myfree(oldptr);
+        return NULL;
+    }
+    if (newsz > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    free_block_t *block = (free_block_t *)((char *)oldptr - HEADER_SIZE);
+    size_t size = block->h & SIZE_MASK;
+    size_t needed = adjust_size(newsz);
+
+    if (needed <= size) {
+        trim_block(block, needed);
+        return oldptr;
+    }
+
+    free_block_t *next = next_block(block);
+    if (next != NULL && (next->h & ALLOC_BIT) == 0 &&
+        size + HEADER_SIZE + next->h >= needed) {
+        remove_free(next);
+        size_t absorbed = HEADER_SIZE + next->h;
+        block->h += absorbed;
+        nused += absorbed;
+
+        free_block_t *after = next_block(block);
+        if (after != NULL) {
+            after->h &= ~PREV_FREE_BIT;
+        }
+        trim_block(block, needed);
+        return oldptr;
+    }
+
+    void *newptr = mymalloc(newsz);
+    if (newptr == NULL) {
+        return NULL;
+    }
+    memcpy(newptr, oldptr, size);
+    myfree(oldptr);
+    return newptr;
+}
+
+/* Function: validate_heap
+ * -----------------------
+ * This function walks every block to check the sizes add up to the segment,
+ * the left-neighbour bits and footers are accurate and no two free blocks
+ * are adjacent, then walks every list to check each free block is filed
+ * under the right indexes and the bitmaps agree with the lists.
+ */
+bool validate_heap() {
+    size_t used = 0;
+    size_t total = 0;
+    size_t nfree_heap = 0;
+    bool prev_free = false;
+
+    for (free_block_t *block = segment_start; block != NULL; block = next_block(block)) {
+        size_t size = block->h & SIZE_MASK;
+        bool is_free = (block->h & ALLOC_BIT) == 0;
+        if (((block->h & PREV_FREE_BIT) != 0) != prev_free) {
+            printf("Block %p has a stale left-neighbour bit\n", block);
+            breakpoint();
+            return false;
+        }
+        if (is_free) {
+            if (prev_free || *(size_t *)((char *)block + HEADER_SIZE + size - sizeof(size_t)) != size) {
+                printf("Free block %p is uncoalesced or has a bad footer\n", block);
+                breakpoint();
+                return false;
+            }
+            nfree_heap++;
+        } else {
+            used += HEADER_SIZE + size;
+        }
+        total += HEADER_SIZE + size;
+        prev_free = is_free;
+    }
+
+    if (total != segment_size || used != nused) {
+        printf("Blocks cover %zu of %zu bytes, %zu used vs %zu counted\n",
+            total, segment_size, used, nused);
+        breakpoint();
+        return false;
+    }
+
+    size_t nfree_lists = 0;
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        if (((fl_bitmap >> fl) & 1) != (sl_bitmap[fl] != 0)) {
+            printf("First-level bitmap disagrees with class %d\n", fl);
+            breakpoint();
+            return false;
+        }
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            if (((sl_bitmap[fl] >> sl) & 1) != (blocks[fl][sl] != NULL)) {
+                printf("Second-level bitmap disagrees with list [%d][%d]\n", fl, sl);
+                breakpoint();
+                return false;
+            }
+            free_block_t *prev = NULL;
+            for (free_block_t *cur = blocks[fl][sl]; cur != NULL; cur = cur->next) {
+                int cur_fl, cur_sl;
+                mapping_insert(cur->h & SIZE_MASK, &cur_fl, &cur_sl);
+                if ((cur->h & ALLOC_BIT) || cur_fl != fl || cur_sl != sl || cur->prev != prev) {
+                    printf("Free block %p is misfiled in list [%d][%d]\n", cur, fl, sl);
+                    breakpoint();
+                    return false;
+                }
+                prev = cur;
+                nfree_lists++;
+            }
+        }
+    }
+
+    if (nfree_lists != nfree_heap) {
+        printf("%zu free blocks in heap but %zu on lists\n", nfree_heap, nfree_lists);
+        breakpoint();
+        return false;
+    }
+    return true;
+}
+
+/* Function: dump_heap
+ * -------------------
+ * This function prints the header of every block in address order, which
+ * is handy to call from gdb.
+ */
+void dump_heap() {
+    printf("Heap segment starts at address %p, ends at %p. %lu bytes currently used.\n",
+        segment_start, (char *)segment_start + segment_size, nused);
+    for (free_block_t *block = segment_start; block != NULL; block = next_block(block)) {
+        printf("%p: %s payload %zu%s\n", block, (block->h & ALLOC_BIT) ? "alloc" : "free ",
+            block->h & SIZE_MASK, (block->h & PREV_FREE_BIT) ? " (prev free)" : "");
+    }
+}